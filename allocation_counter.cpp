@@ -0,0 +1,110 @@
+/*
+ * Copyright 2016 Boris Kochergin. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdlib>
+#include <new>
+
+#include "allocation_counter.h"
+
+#ifdef COUNT_ALLOCATIONS
+
+static thread_local uint64_t num_thread_allocations = 0;
+
+// glibc's own allocator, which its malloc() and friends are aliases of and
+// which replacing them leaves callable.
+extern "C" {
+void* __libc_malloc(std::size_t size);
+void* __libc_calloc(std::size_t count, std::size_t size);
+void* __libc_realloc(void* pointer, std::size_t size);
+}
+
+extern "C" void* malloc(std::size_t size) {
+  ++num_thread_allocations;
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(std::size_t count, std::size_t size) {
+  ++num_thread_allocations;
+  return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* pointer, std::size_t size) {
+  ++num_thread_allocations;
+  return __libc_realloc(pointer, size);
+}
+
+static void* CountedAllocate(std::size_t size) {
+  void* pointer = malloc(size == 0 ? 1 : size);
+  if (pointer == nullptr) {
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+void* operator new(std::size_t size) {
+  return CountedAllocate(size);
+}
+
+void* operator new[](std::size_t size) {
+  return CountedAllocate(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return malloc(size == 0 ? 1 : size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return malloc(size == 0 ? 1 : size);
+}
+
+void operator delete(void* pointer) noexcept {
+  free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+  free(pointer);
+}
+
+uint64_t NumThreadAllocations() {
+  return num_thread_allocations;
+}
+
+UncountedAllocations::UncountedAllocations() :
+    num_allocations_(num_thread_allocations) {}
+
+UncountedAllocations::~UncountedAllocations() {
+  num_thread_allocations = num_allocations_;
+}
+
+#else
+
+uint64_t NumThreadAllocations() {
+  return 0;
+}
+
+UncountedAllocations::UncountedAllocations() : num_allocations_(0) {}
+
+UncountedAllocations::~UncountedAllocations() {}
+
+#endif
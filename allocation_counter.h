@@ -0,0 +1,51 @@
+/*
+ * Copyright 2016 Boris Kochergin. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdint>
+
+// In builds with COUNT_ALLOCATIONS defined, malloc(), calloc() and realloc(),
+// and global operator new through them, count the calls each thread makes,
+// so that paths that shouldn't allocate can be checked. Arena blocks aren't
+// counted, since an arena only grows until it has seen its largest request.
+#ifdef COUNT_ALLOCATIONS
+static const bool kCountAllocations = true;
+#else
+static const bool kCountAllocations = false;
+#endif
+
+// Returns the number of times this thread has allocated memory, or 0 if
+// allocations aren't counted.
+uint64_t NumThreadAllocations();
+
+// Leaves the allocations this thread makes for as long as it exists out of
+// its count, for state that outlives requests and is set up or refreshed by
+// whichever one comes first.
+class UncountedAllocations {
+ public:
+  UncountedAllocations();
+  ~UncountedAllocations();
+
+ private:
+  const uint64_t num_allocations_;
+};
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2016 Boris Kochergin. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include "allocation_counter.h"
+#include "arena.h"
+
+static const size_t kAlignment = alignof(std::max_align_t);
+
+static thread_local Arena* current_arena = nullptr;
+
+static size_t AlignUp(size_t size) {
+  return (size + kAlignment - 1) & ~(kAlignment - 1);
+}
+
+Arena::Arena(size_t block_size) :
+    blocks_(nullptr), position_(nullptr), end_(nullptr), total_size_(0) {
+  AddBlock(block_size);
+}
+
+Arena::~Arena() {
+  FreeBlocks();
+}
+
+void* Arena::Allocate(size_t size) {
+  size = AlignUp(size);
+  if (size > size_t(end_ - position_)) {
+    AddBlock(size);
+  }
+  void* result = position_;
+  position_ += size;
+  return result;
+}
+
+void Arena::Reset() {
+  if (blocks_->next != nullptr) {
+    const size_t total_size = total_size_;
+    FreeBlocks();
+    AddBlock(total_size);
+    return;
+  }
+  position_ = (char*)blocks_ + AlignUp(sizeof(Block));
+}
+
+void Arena::FreeBlocks() {
+  while (blocks_ != nullptr) {
+    Block* next = blocks_->next;
+    free(blocks_);
+    blocks_ = next;
+  }
+  total_size_ = 0;
+}
+
+Arena* Arena::current() {
+  return current_arena;
+}
+
+void Arena::AddBlock(size_t size) {
+  // Grow geometrically, so that a request that outgrows its block doesn't
+  // chain one block per allocation.
+  size = std::max(size, total_size_);
+
+  // An arena only grows until it has seen its largest request, so its blocks
+  // aren't counted against the request that grows it.
+  UncountedAllocations uncounted_allocations;
+  const size_t header_size = AlignUp(sizeof(Block));
+  Block* block = (Block*)malloc(header_size + size);
+  if (block == nullptr) {
+    throw std::bad_alloc();
+  }
+  block->next = blocks_;
+  block->size = size;
+  blocks_ = block;
+  position_ = (char*)block + header_size;
+  end_ = position_ + size;
+  total_size_ += size;
+}
+
+Arena::Scope::Scope(Arena* arena) : arena_(arena), previous_(current_arena) {
+  current_arena = arena_;
+}
+
+Arena::Scope::~Scope() {
+  current_arena = previous_;
+  arena_->Reset();
+}
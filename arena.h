@@ -0,0 +1,131 @@
+/*
+ * Copyright 2016 Boris Kochergin. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstddef>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// A monotonic arena for memory that lives only as long as one request.
+// Allocation bumps a pointer, deallocation does nothing, and Reset() frees
+// everything at once. An arena that overflows its block chains more, and on
+// Reset() replaces them with one block big enough for all of them, so a
+// recycled arena settles into not allocating at all.
+class Arena {
+ public:
+  explicit Arena(size_t block_size = 64 * 1024);
+  ~Arena();
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  // Returns memory aligned for any type.
+  void* Allocate(size_t size);
+
+  void Reset();
+
+  // The arena of the innermost scope on this thread, or null.
+  static Arena* current();
+
+  // Makes an arena the current one for this thread, and resets it once the
+  // scope ends.
+  class Scope {
+   public:
+    explicit Scope(Arena* arena);
+    ~Scope();
+
+   private:
+    Arena* const arena_;
+    Arena* const previous_;
+  };
+
+ private:
+  struct Block {
+    Block* next;
+    size_t size;
+  };
+
+  // Adds a block with room for at least "size" bytes.
+  void AddBlock(size_t size);
+  void FreeBlocks();
+
+  Block* blocks_;
+  char* position_;
+  char* end_;
+
+  // Total size of the blocks in use, which the next Reset() consolidates to.
+  size_t total_size_;
+};
+
+// Allocates from an arena, or from the heap if it has none. Default-constructed
+// allocators take the current arena, so temporaries built while a scope is
+// active land in its arena, and anything meant to outlive it must be built
+// with a null arena explicitly. Copies keep the allocator of what they copy.
+template <typename T>
+class ArenaAllocator {
+ public:
+  typedef T value_type;
+  typedef std::false_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  ArenaAllocator() : arena_(Arena::current()) {}
+  explicit ArenaAllocator(Arena* arena) : arena_(arena) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.arena()) {}
+
+  T* allocate(size_t count) {
+    if (arena_ == nullptr) {
+      return (T*)::operator new(count * sizeof(T));
+    }
+    return (T*)arena_->Allocate(count * sizeof(T));
+  }
+
+  void deallocate(T* pointer, size_t) {
+    if (arena_ == nullptr) {
+      ::operator delete(pointer);
+    }
+  }
+
+  Arena* arena() const { return arena_; }
+
+ private:
+  Arena* arena_;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+  return a.arena() == b.arena();
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+  return a.arena() != b.arena();
+}
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>>
+    ArenaString;
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2016 Boris Kochergin. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+
+#include "bloom_filter.h"
+
+// Bits set per hash.
+static const unsigned int kNumProbes = 4;
+
+BloomFilter::BloomFilter(size_t num_bits) {
+  size_t num_words = 1;
+  while (num_words * 64 < num_bits) {
+    num_words *= 2;
+  }
+  words_.resize(num_words);
+  mask_ = num_words * 64 - 1;
+}
+
+bool BloomFilter::TestAndSet(uint64_t hash) {
+  // Probes are spaced by the hash's halves swapped, which is odd so that they
+  // never repeat.
+  const uint64_t step = ((hash << 32) | (hash >> 32)) | 1;
+  bool present = true;
+  for (unsigned int i = 0; i < kNumProbes; ++i) {
+    const uint64_t bit = (hash + i * step) & mask_;
+    uint64_t& word = words_[bit / 64];
+    const uint64_t bit_mask = uint64_t(1) << (bit % 64);
+    if (!(word & bit_mask)) {
+      present = false;
+      word |= bit_mask;
+    }
+  }
+  return present;
+}
+
+void BloomFilter::Clear() {
+  std::fill(words_.begin(), words_.end(), 0);
+}
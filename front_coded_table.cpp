@@ -0,0 +1,155 @@
+/*
+ * Copyright 2016 Boris Kochergin. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "arena.h"
+#include "front_coded_table.h"
+
+FrontCodedTable::FrontCodedTable(Compare compare) :
+    compare_(compare), num_rows_(0) {}
+
+void FrontCodedTable::Append(const char* name, size_t name_size,
+                             const char* value, size_t value_size) {
+  size_t shared = 0;
+  if (num_rows_ % kRestartInterval == 0) {
+    restarts_.push_back(data_.size());
+  } else {
+    while (shared < name_size && shared < last_name_.size() &&
+           name[shared] == last_name_[shared]) {
+      ++shared;
+    }
+  }
+  AppendLength(shared, &data_);
+  AppendLength(name_size - shared, &data_);
+  AppendLength(value_size, &data_);
+  data_.append(name + shared, name_size - shared);
+  data_.append(value, value_size);
+  last_name_.assign(name, name_size);
+  ++num_rows_;
+}
+
+void FrontCodedTable::ShrinkToFit() {
+  data_.shrink_to_fit();
+  restarts_.shrink_to_fit();
+  last_name_.shrink_to_fit();
+}
+
+size_t FrontCodedTable::size() const {
+  return num_rows_;
+}
+
+size_t FrontCodedTable::memory_size() const {
+  return data_.capacity() + restarts_.capacity() * sizeof(size_t) +
+         last_name_.capacity();
+}
+
+size_t FrontCodedTable::DecodeLength(const char** position) {
+  size_t result = 0;
+  unsigned int shift = 0;
+  uint8_t digit;
+  do {
+    digit = **position;
+    ++*position;
+    result |= size_t(digit & 0x7f) << shift;
+    shift += 7;
+  } while (digit & 0x80);
+  return result;
+}
+
+void FrontCodedTable::AppendLength(size_t length, std::string* data) {
+  while (length >= 0x80) {
+    *data += char((length & 0x7f) | 0x80);
+    length >>= 7;
+  }
+  *data += char(length);
+}
+
+FrontCodedTable::Cursor::Cursor(const FrontCodedTable* table) :
+    table_(table), row_(table->num_rows_), offset_(table->data_.size()),
+    next_offset_(table->data_.size()), value_(nullptr), value_size_(0) {}
+
+void FrontCodedTable::Cursor::SeekPast(const char* name, size_t name_size) {
+  // Find the first block whose whole name follows "name". The row sought is
+  // either the first of it or in the block before.
+  size_t low = 0;
+  size_t high = table_->restarts_.size();
+  while (low < high) {
+    const size_t middle = low + (high - low) / 2;
+    const char* position = table_->data_.data() + table_->restarts_[middle];
+    DecodeLength(&position);
+    const size_t restart_name_size = DecodeLength(&position);
+    DecodeLength(&position);
+    if (table_->compare_(position, restart_name_size, name, name_size) > 0) {
+      high = middle;
+    } else {
+      low = middle + 1;
+    }
+  }
+  row_ = low == 0 ? 0 : (low - 1) * kRestartInterval;
+  offset_ = low == 0 ? 0 : table_->restarts_[low - 1];
+  Decode();
+  while (valid() &&
+         table_->compare_(name_.data(), name_.size(), name, name_size) <= 0) {
+    Next();
+  }
+}
+
+bool FrontCodedTable::Cursor::valid() const {
+  return offset_ < table_->data_.size();
+}
+
+void FrontCodedTable::Cursor::Next() {
+  ++row_;
+  offset_ = next_offset_;
+  Decode();
+}
+
+size_t FrontCodedTable::Cursor::row() const {
+  return row_;
+}
+
+const ArenaString& FrontCodedTable::Cursor::name() const {
+  return name_;
+}
+
+const char* FrontCodedTable::Cursor::value() const {
+  return value_;
+}
+
+size_t FrontCodedTable::Cursor::value_size() const {
+  return value_size_;
+}
+
+void FrontCodedTable::Cursor::Decode() {
+  if (!valid()) {
+    return;
+  }
+  const char* position = table_->data_.data() + offset_;
+  const size_t shared = DecodeLength(&position);
+  const size_t unshared = DecodeLength(&position);
+  value_size_ = DecodeLength(&position);
+  name_.resize(shared);
+  name_.append(position, unshared);
+  value_ = position + unshared;
+  next_offset_ = value_ + value_size_ - table_->data_.data();
+}
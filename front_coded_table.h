@@ -0,0 +1,104 @@
+/*
+ * Copyright 2016 Boris Kochergin. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// arena.h must be included first.
+
+// Rows of names and values in name order, stored front-coded: each name as
+// the number of leading bytes it shares with the one before and the bytes
+// after them. Every kRestartInterval-th name is stored whole, so that a seek
+// binary searches those and decodes at most a block of names after. Values
+// are stored as given. Once built, it may be read from several threads.
+class FrontCodedTable {
+ public:
+  // Orders two names like memcmp() does.
+  typedef int (*Compare)(const char* a, size_t a_size, const char* b,
+                         size_t b_size);
+
+  explicit FrontCodedTable(Compare compare);
+
+  // Adds a row, whose name must follow the last one's.
+  void Append(const char* name, size_t name_size, const char* value,
+              size_t value_size);
+
+  // Frees space reserved for rows that will not be added.
+  void ShrinkToFit();
+
+  size_t size() const;
+
+  // Bytes the rows take up.
+  size_t memory_size() const;
+
+  // Reads rows in order, decoding their names in the current thread's arena.
+  class Cursor {
+   public:
+    explicit Cursor(const FrontCodedTable* table);
+
+    // Moves to the first row whose name follows "name".
+    void SeekPast(const char* name, size_t name_size);
+
+    // Whether the cursor is on a row, rather than past the last one.
+    bool valid() const;
+
+    void Next();
+
+    // The number of the row, counting from 0.
+    size_t row() const;
+
+    const ArenaString& name() const;
+    const char* value() const;
+    size_t value_size() const;
+
+   private:
+    // Decodes the row at offset_, whose name shares its prefix with name_.
+    void Decode();
+
+    const FrontCodedTable* table_;
+    size_t row_;
+    size_t offset_;
+    size_t next_offset_;
+    ArenaString name_;
+    const char* value_;
+    size_t value_size_;
+  };
+
+ private:
+  static const size_t kRestartInterval = 16;
+
+  // Decodes a base-128 number, least significant digit first.
+  static size_t DecodeLength(const char** position);
+  static void AppendLength(size_t length, std::string* data);
+
+  const Compare compare_;
+  std::string data_;
+
+  // Offsets of the rows whose names are stored whole.
+  std::vector<size_t> restarts_;
+  size_t num_rows_;
+  std::string last_name_;
+};
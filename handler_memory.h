@@ -0,0 +1,145 @@
+/*
+ * Copyright 2016 Boris Kochergin. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+// Memory for the handlers of a thread's asynchronous operations. Asio
+// allocates an operation object for every async_* call and frees it before
+// the handler runs, so a few fixed slots, reused over and over, cover a
+// thread that only ever has a couple of operations outstanding. Anything that
+// doesn't fit goes to the heap.
+class HandlerMemory {
+ public:
+  HandlerMemory();
+
+  HandlerMemory(const HandlerMemory&) = delete;
+  HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+  void* Allocate(size_t size);
+  void Deallocate(void* pointer);
+
+ private:
+  static const size_t kNumSlots = 4;
+  static const size_t kSlotSize = 512;
+
+  struct Slot {
+    alignas(std::max_align_t) char storage[kSlotSize];
+  };
+  Slot slots_[kNumSlots];
+  bool slot_in_use_[kNumSlots];
+};
+
+template <typename T>
+class HandlerAllocator {
+ public:
+  typedef T value_type;
+
+  explicit HandlerAllocator(HandlerMemory* memory) : memory_(memory) {}
+  template <typename U>
+  HandlerAllocator(const HandlerAllocator<U>& other) :
+      memory_(other.memory()) {}
+
+  T* allocate(size_t count) {
+    return (T*)memory_->Allocate(count * sizeof(T));
+  }
+
+  void deallocate(T* pointer, size_t) {
+    memory_->Deallocate(pointer);
+  }
+
+  HandlerMemory* memory() const { return memory_; }
+
+ private:
+  HandlerMemory* memory_;
+};
+
+template <typename T, typename U>
+bool operator==(const HandlerAllocator<T>& a, const HandlerAllocator<U>& b) {
+  return a.memory() == b.memory();
+}
+
+template <typename T, typename U>
+bool operator!=(const HandlerAllocator<T>& a, const HandlerAllocator<U>& b) {
+  return a.memory() != b.memory();
+}
+
+// Wraps a completion handler so that asio allocates its operation from
+// handler memory, through the associated allocator.
+template <typename Handler>
+class MemoryHandler {
+ public:
+  typedef HandlerAllocator<Handler> allocator_type;
+
+  MemoryHandler(HandlerMemory* memory, Handler handler) :
+      memory_(memory), handler_(std::move(handler)) {}
+
+  allocator_type get_allocator() const {
+    return allocator_type(memory_);
+  }
+
+  template <typename... Args>
+  void operator()(Args&&... args) {
+    handler_(std::forward<Args>(args)...);
+  }
+
+ private:
+  HandlerMemory* memory_;
+  Handler handler_;
+};
+
+template <typename Handler>
+MemoryHandler<Handler> MakeMemoryHandler(HandlerMemory* memory,
+                                         Handler handler) {
+  return MemoryHandler<Handler>(memory, std::move(handler));
+}
+
+inline HandlerMemory::HandlerMemory() {
+  for (size_t i = 0; i < kNumSlots; ++i) {
+    slot_in_use_[i] = false;
+  }
+}
+
+inline void* HandlerMemory::Allocate(size_t size) {
+  if (size <= kSlotSize) {
+    for (size_t i = 0; i < kNumSlots; ++i) {
+      if (!slot_in_use_[i]) {
+        slot_in_use_[i] = true;
+        return slots_[i].storage;
+      }
+    }
+  }
+  return ::operator new(size);
+}
+
+inline void HandlerMemory::Deallocate(void* pointer) {
+  for (size_t i = 0; i < kNumSlots; ++i) {
+    if (pointer == slots_[i].storage) {
+      slot_in_use_[i] = false;
+      return;
+    }
+  }
+  ::operator delete(pointer);
+}
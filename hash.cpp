@@ -0,0 +1,107 @@
+/*
+ * Copyright 2016 Boris Kochergin. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+
+#include "hash.h"
+
+static const uint64_t kSecrets[] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull,
+    0x589965cc75374cc3ull};
+
+// Multiplies two 64-bit integers into 128 bits and folds the halves.
+static uint64_t Mix(uint64_t a, uint64_t b) {
+  const __uint128_t product = __uint128_t(a) * b;
+  return uint64_t(product) ^ uint64_t(product >> 64);
+}
+
+static uint64_t Read64(const char* data) {
+  uint64_t result;
+  memcpy(&result, data, sizeof(result));
+  return result;
+}
+
+static uint64_t Read32(const char* data) {
+  uint32_t result;
+  memcpy(&result, data, sizeof(result));
+  return result;
+}
+
+// Reads 1 to 3 bytes.
+static uint64_t ReadSmall(const char* data, size_t size) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  return (uint64_t(bytes[0]) << 16) | (uint64_t(bytes[size >> 1]) << 8) |
+         bytes[size - 1];
+}
+
+uint64_t HashBytes(const char* data, size_t size, uint64_t seed) {
+  seed ^= Mix(seed ^ kSecrets[0], kSecrets[1]);
+  uint64_t a, b;
+  if (size <= 16) {
+    if (size >= 4) {
+      // Two overlapping pairs of 4-byte reads cover 4 to 16 bytes.
+      const size_t offset = (size >> 3) << 2;
+      a = (Read32(data) << 32) | Read32(data + offset);
+      b = (Read32(data + size - 4) << 32) | Read32(data + size - 4 - offset);
+    } else if (size > 0) {
+      a = ReadSmall(data, size);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    const char* position = data;
+    size_t remaining = size;
+    if (remaining > 48) {
+      // Three lanes with no dependencies between them, so that the
+      // multiplies overlap.
+      uint64_t lane1 = seed, lane2 = seed;
+      do {
+        seed = Mix(Read64(position) ^ kSecrets[1],
+                   Read64(position + 8) ^ seed);
+        lane1 = Mix(Read64(position + 16) ^ kSecrets[2],
+                    Read64(position + 24) ^ lane1);
+        lane2 = Mix(Read64(position + 32) ^ kSecrets[3],
+                    Read64(position + 40) ^ lane2);
+        position += 48;
+        remaining -= 48;
+      } while (remaining > 48);
+      seed ^= lane1 ^ lane2;
+    }
+    while (remaining > 16) {
+      seed = Mix(Read64(position) ^ kSecrets[1], Read64(position + 8) ^ seed);
+      position += 16;
+      remaining -= 16;
+    }
+    // The last 16 bytes, which may overlap ones already hashed.
+    a = Read64(position + remaining - 16);
+    b = Read64(position + remaining - 8);
+  }
+  a ^= kSecrets[1];
+  b ^= seed;
+  const __uint128_t product = __uint128_t(a) * b;
+  a = uint64_t(product);
+  b = uint64_t(product >> 64);
+  return Mix(a ^ kSecrets[0] ^ size, b ^ kSecrets[1]);
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright 2016 Boris Kochergin. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// A bounded, lock-free, multi-producer, multi-consumer queue (after Dmitry
+// Vyukov's). Each cell carries a sequence number that tells producers and
+// consumers whose turn it is to use it, so they only contend on the enqueue
+// and dequeue positions, which live on cache lines of their own, as do the
+// cells.
+template <typename T>
+class MPMCQueue {
+ public:
+  // Capacity is rounded up to a power of two.
+  explicit MPMCQueue(size_t capacity);
+  ~MPMCQueue();
+
+  MPMCQueue(const MPMCQueue&) = delete;
+  MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+  // Returns false if the queue is full.
+  bool TryEnqueue(const T& item);
+
+  // Enqueues as many of the items as there is room for, in order, with a
+  // single update of the enqueue position. Returns the number enqueued.
+  size_t TryEnqueueBatch(const T* items, size_t count);
+
+  // Returns false if the queue is empty.
+  bool TryDequeue(T* item);
+
+  // Dequeues up to "max_count" items with a single update of the dequeue
+  // position. Returns the number dequeued.
+  size_t TryDequeueBatch(T* items, size_t max_count);
+
+  // Whether the queue looked empty at some point during the call.
+  bool Empty() const;
+
+ private:
+  static const size_t kCacheLineSize = 64;
+
+  struct alignas(kCacheLineSize) Cell {
+    std::atomic<size_t> sequence;
+    T item;
+  };
+
+  // Padded rather than aligned, since objects holding a queue may come from
+  // plain new.
+  Cell* cells_;
+  size_t mask_;
+  char padding0_[kCacheLineSize];
+  std::atomic<size_t> enqueue_position_;
+  char padding1_[kCacheLineSize - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> dequeue_position_;
+  char padding2_[kCacheLineSize - sizeof(std::atomic<size_t>)];
+
+  // Claims up to "max_count" consecutive cells starting at a position, each
+  // of which must be at the given sequence offset from its position. Returns
+  // the first claimed position in "start".
+  size_t Claim(std::atomic<size_t>* position, size_t sequence_offset,
+               size_t max_count, size_t* start);
+};
+
+template <typename T>
+MPMCQueue<T>::MPMCQueue(size_t capacity) :
+    enqueue_position_(0), dequeue_position_(0) {
+  size_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  mask_ = size - 1;
+
+  // Plain new doesn't honor cache line alignment before C++17.
+  void* memory;
+  if (posix_memalign(&memory, kCacheLineSize, sizeof(Cell) * size) != 0) {
+    throw std::bad_alloc();
+  }
+  cells_ = (Cell*)memory;
+  for (size_t i = 0; i < size; ++i) {
+    new (&cells_[i]) Cell;
+    cells_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+template <typename T>
+MPMCQueue<T>::~MPMCQueue() {
+  for (size_t i = 0; i <= mask_; ++i) {
+    cells_[i].~Cell();
+  }
+  free(cells_);
+}
+
+template <typename T>
+bool MPMCQueue<T>::TryEnqueue(const T& item) {
+  return TryEnqueueBatch(&item, 1) == 1;
+}
+
+template <typename T>
+size_t MPMCQueue<T>::TryEnqueueBatch(const T* items, size_t count) {
+  // A cell is free for the producer at position p when its sequence is p.
+  size_t start;
+  const size_t claimed = Claim(&enqueue_position_, 0, count, &start);
+  for (size_t i = 0; i < claimed; ++i) {
+    Cell& cell = cells_[(start + i) & mask_];
+    cell.item = items[i];
+    cell.sequence.store(start + i + 1, std::memory_order_release);
+  }
+  return claimed;
+}
+
+template <typename T>
+bool MPMCQueue<T>::TryDequeue(T* item) {
+  return TryDequeueBatch(item, 1) == 1;
+}
+
+template <typename T>
+size_t MPMCQueue<T>::TryDequeueBatch(T* items, size_t max_count) {
+  // A cell is full for the consumer at position p when its sequence is p + 1.
+  size_t start;
+  const size_t claimed = Claim(&dequeue_position_, 1, max_count, &start);
+  for (size_t i = 0; i < claimed; ++i) {
+    Cell& cell = cells_[(start + i) & mask_];
+    items[i] = cell.item;
+    cell.sequence.store(start + i + mask_ + 1, std::memory_order_release);
+  }
+  return claimed;
+}
+
+template <typename T>
+bool MPMCQueue<T>::Empty() const {
+  const size_t position = dequeue_position_.load(std::memory_order_seq_cst);
+  return cells_[position & mask_].sequence.load(std::memory_order_seq_cst) !=
+         position + 1;
+}
+
+template <typename T>
+size_t MPMCQueue<T>::Claim(std::atomic<size_t>* position,
+                           size_t sequence_offset, size_t max_count,
+                           size_t* start) {
+  size_t current = position->load(std::memory_order_relaxed);
+  while (true) {
+    // Count the cells that are ready for us. Once we own their positions, no
+    // one else can make them unready.
+    size_t count = 0;
+    while (count < max_count &&
+           cells_[(current + count) & mask_].sequence.load(
+               std::memory_order_acquire) ==
+               current + count + sequence_offset) {
+      ++count;
+    }
+    if (count == 0) {
+      // Either the queue is full (or empty), or another thread has moved the
+      // position past us.
+      const size_t latest = position->load(std::memory_order_relaxed);
+      if (latest == current) {
+        return 0;
+      }
+      current = latest;
+      continue;
+    }
+    if (position->compare_exchange_weak(current, current + count,
+                                        std::memory_order_relaxed)) {
+      *start = current;
+      return count;
+    }
+  }
+}
@@ -0,0 +1,251 @@
+/*
+ * Copyright 2016 Boris Kochergin. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "mpmc_queue.h"
+
+// Hands items from producers to consumers the way the proxy's receiver
+// hands requests to workers: through an MPMCQueue, with producers retrying
+// when it is full and consumers when it is empty, one item at a time and in
+// batches, and through a deque behind a mutex, with consumers waiting on a
+// condition variable, as workers did before.
+
+static const size_t kQueueSize = 1024;
+
+// Items each producer enqueues at once, and each consumer dequeues at most,
+// in the batched runs: as many as the receiver drains before enqueueing,
+// and as many as a worker dequeues.
+static const size_t kEnqueueBatchSize = 32;
+static const size_t kDequeueBatchSize = 4;
+
+class LockedQueue {
+ public:
+  void Enqueue(uint64_t item) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      items_.push_back(item);
+    }
+    cv_.notify_one();
+  }
+
+  // Returns false once "stopped" is set and the queue is empty.
+  bool Dequeue(const std::atomic<bool>& stopped, uint64_t* item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this, &stopped] {
+      return !items_.empty() || stopped.load();
+    });
+    if (items_.empty()) {
+      return false;
+    }
+    *item = items_.front();
+    items_.pop_front();
+    return true;
+  }
+
+  void Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cv_.notify_all();
+  }
+
+ private:
+  std::deque<uint64_t> items_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
+// Runs producers and consumers, and returns millions of items handed over
+// per second, or a negative number if the consumers didn't get them all.
+static double Run(unsigned int num_producers, unsigned int num_consumers,
+                  uint64_t items_per_producer,
+                  const std::function<void(uint64_t)>& produce,
+                  const std::function<void(uint64_t*, uint64_t*)>& consume) {
+  const std::chrono::steady_clock::time_point start_time =
+      std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  std::vector<uint64_t> counts(num_consumers, 0);
+  std::vector<uint64_t> sums(num_consumers, 0);
+  for (unsigned int i = 0; i < num_consumers; ++i) {
+    threads.emplace_back([&consume, &counts, &sums, i] {
+      consume(&counts[i], &sums[i]);
+    });
+  }
+  std::vector<std::thread> producer_threads;
+  for (unsigned int i = 0; i < num_producers; ++i) {
+    producer_threads.emplace_back([&produce, items_per_producer, i] {
+      for (uint64_t item = 1; item <= items_per_producer; ++item) {
+        produce(i * items_per_producer + item);
+      }
+    });
+  }
+  for (std::thread& producer_thread : producer_threads) {
+    producer_thread.join();
+  }
+  produce(0);
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  const double elapsed_sec = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start_time).count();
+
+  // Items are numbered from 1, so they add up to n(n + 1)/2.
+  const uint64_t num_items = num_producers * items_per_producer;
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  for (unsigned int i = 0; i < num_consumers; ++i) {
+    count += counts[i];
+    sum += sums[i];
+  }
+  if (count != num_items || sum != num_items * (num_items + 1) / 2) {
+    return -1;
+  }
+  return num_items / elapsed_sec / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+  const unsigned int num_producers = argc > 1 ? atoi(argv[1]) : 4;
+  const unsigned int num_consumers = argc > 2 ? atoi(argv[2]) : 4;
+  const uint64_t items_per_producer =
+      argc > 3 ? strtoull(argv[3], nullptr, 10) : 1000000;
+  if (num_producers == 0 || num_consumers == 0) {
+    std::cerr << "Usage: " << argv[0]
+              << " [producers] [consumers] [items per producer]" << std::endl;
+    return 1;
+  }
+  std::cout << num_producers << " producers, " << num_consumers
+            << " consumers, " << items_per_producer
+            << " items per producer, " << std::thread::hardware_concurrency()
+            << " CPUs." << std::endl;
+
+  // Producing item 0 tells the consumers that the producers are done.
+  MPMCQueue<uint64_t> queue(kQueueSize);
+  std::atomic<bool> stopped(false);
+  const double queue_rate = Run(
+      num_producers, num_consumers, items_per_producer,
+      [&queue, &stopped](uint64_t item) {
+        if (item == 0) {
+          stopped = true;
+          return;
+        }
+        while (!queue.TryEnqueue(item)) {
+          std::this_thread::yield();
+        }
+      },
+      [&queue, &stopped](uint64_t* count, uint64_t* sum) {
+        uint64_t item;
+        while (true) {
+          if (queue.TryDequeue(&item)) {
+            ++*count;
+            *sum += item;
+          } else if (stopped.load() && queue.Empty()) {
+            return;
+          } else {
+            std::this_thread::yield();
+          }
+        }
+      });
+  std::cout << "MPMCQueue: " << queue_rate << " million items/s."
+            << std::endl;
+
+  // Each producer's last item flushes its batch.
+  MPMCQueue<uint64_t> batch_queue(kQueueSize);
+  std::atomic<bool> batch_stopped(false);
+  const double batch_rate = Run(
+      num_producers, num_consumers, items_per_producer,
+      [&batch_queue, &batch_stopped, items_per_producer](uint64_t item) {
+        static thread_local std::vector<uint64_t> batch;
+        if (item == 0) {
+          batch_stopped = true;
+          return;
+        }
+        batch.push_back(item);
+        if (batch.size() < kEnqueueBatchSize &&
+            item % items_per_producer != 0) {
+          return;
+        }
+        size_t num_enqueued = 0;
+        while (num_enqueued < batch.size()) {
+          const size_t count = batch_queue.TryEnqueueBatch(
+              batch.data() + num_enqueued, batch.size() - num_enqueued);
+          if (count == 0) {
+            std::this_thread::yield();
+          }
+          num_enqueued += count;
+        }
+        batch.clear();
+      },
+      [&batch_queue, &batch_stopped](uint64_t* count, uint64_t* sum) {
+        uint64_t items[kDequeueBatchSize];
+        while (true) {
+          const size_t num_items =
+              batch_queue.TryDequeueBatch(items, kDequeueBatchSize);
+          if (num_items > 0) {
+            for (size_t i = 0; i < num_items; ++i) {
+              ++*count;
+              *sum += items[i];
+            }
+          } else if (batch_stopped.load() && batch_queue.Empty()) {
+            return;
+          } else {
+            std::this_thread::yield();
+          }
+        }
+      });
+  std::cout << "MPMCQueue, in batches of " << kEnqueueBatchSize << " and "
+            << kDequeueBatchSize << ": " << batch_rate << " million items/s."
+            << std::endl;
+
+  LockedQueue locked_queue;
+  std::atomic<bool> locked_stopped(false);
+  const double locked_rate = Run(
+      num_producers, num_consumers, items_per_producer,
+      [&locked_queue, &locked_stopped](uint64_t item) {
+        if (item == 0) {
+          locked_stopped = true;
+          locked_queue.Stop();
+          return;
+        }
+        locked_queue.Enqueue(item);
+      },
+      [&locked_queue, &locked_stopped](uint64_t* count, uint64_t* sum) {
+        uint64_t item;
+        while (locked_queue.Dequeue(locked_stopped, &item)) {
+          ++*count;
+          *sum += item;
+        }
+      });
+  std::cout << "Mutex and deque: " << locked_rate << " million items/s."
+            << std::endl;
+  return queue_rate < 0 || batch_rate < 0 || locked_rate < 0 ? 1 : 0;
+}
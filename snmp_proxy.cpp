@@ -22,419 +22,4070 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <algorithm>
+#include <cctype>
 #include <chrono>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <functional>
+#include <initializer_list>
 #include <iostream>
+#include <limits>
 #include <thread>
 
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
-#include <boost/bind.hpp>
 
 #include "snmp_proxy.h"
 
 static const uint8_t kSequenceType = 0x30;
 static const uint8_t kIntegerType = 0x02;
 static const uint8_t kStringType = 0x04;
+static const uint8_t kNullType = 0x05;
+static const uint8_t kObjectIdentifierType = 0x06;
+static const uint8_t kEndOfMibViewType = 0x82;
 static const std::string kSNMPv2cVersion = "\x02\x01\x01";
 static const uint8_t kGetRequestPDUType = 0xa0;
 static const uint8_t kGetNextRequestPDUType = 0xa1;
 static const uint8_t kGetResponsePDUType = 0xa2;
 static const uint8_t kGetBulkRequestPDUType = 0xa5;
+static const uint8_t kInformRequestPDUType = 0xa6;
+static const uint8_t kSNMPv2TrapPDUType = 0xa7;
+static const uint8_t kIpAddressType = 0x40;
 static const uint8_t kResourceUnavailableError = 0xd;
+static const uint32_t kHandoffStreamVersion = 5;
 
-SNMPProxy::SNMPProxy(uint16_t port, const std::string& backend_community,
-                     std::time_t backend_timeout_sec,
-                     unsigned int num_backend_retries,
-                     std::time_t cache_ttl_sec) :
-    port_(port), backend_community_(backend_community),
-    backend_timeout_sec_(backend_timeout_sec),
-    num_backend_retries_(num_backend_retries), cache_ttl_sec_(cache_ttl_sec) {}
-
-bool SNMPProxy::Start() {
-  udp::socket socket(io_service_);
-  socket.open(udp::v4());
-  boost::system::error_code error;
-  socket.bind(udp::endpoint(udp::v4(), port_), error);
-  if (error) {
-    std::cerr << "Could not bind to port " << port_ << ": " << error.message()
-              << std::endl;
-    return false;
-  }
-  std::thread eviction_thread(&SNMPProxy::EvictStaleCacheEntries, this);
-  eviction_thread.detach();
-  while (true) {
-    boost::array<char, 65536> packet;
-    udp::endpoint remote_endpoint;
-    boost::system::error_code error;
-    const size_t packet_size =
-        socket.receive_from(boost::asio::buffer(packet), remote_endpoint, 0,
-                             error);
-    SNMPSequence snmp_sequence(packet.data(), packet.data() + packet_size);
-
-    if (!snmp_sequence.initialized() ||
-        (snmp_sequence.pdu_type() != kGetRequestPDUType &&
-         snmp_sequence.pdu_type() != kGetNextRequestPDUType &&
-         snmp_sequence.pdu_type() != kGetBulkRequestPDUType)) {
-      continue;
-    }
-
-    std::cout << "Got SNMPv2c request from " << remote_endpoint
-              << " (community=" << snmp_sequence.community()
-              << snmp_sequence.community_index() << ")." << std::endl;
+// Requests that don't fit in a worker's buffer are served by the receiving
+// thread.
+static const size_t kRequestBufferSize = 4096;
 
-    if (error && error != boost::asio::error::message_size) {
-      throw boost::system::system_error(error);
-    }
+// Most datagrams received, and requests dequeued by a worker, at a time.
+// Workers take few, so that most of what they hold is left for thieves.
+static const size_t kReceiveBatchSize = 32;
+static const size_t kWorkerBatchSize = 4;
 
-    boost::system::error_code ignored_error;
-    const std::string backend_host = snmp_sequence.community();
-    snmp_sequence.set_community(backend_community_ +
-                                snmp_sequence.community_index());
-    socket.send_to(
-        boost::asio::buffer(GetResponse(backend_host, snmp_sequence)),
-        remote_endpoint, 0, ignored_error);
-  }
-  return true;
-}
+// Requests each thread serves before allocation checks start.
+static const uint64_t kAllocationWarmUpRequests = 100;
 
-SNMPProxy::SNMPSequence::SNMPSequence(const char* start, const char* end) :
-    initialized_(false) {
-  if (end - start < 7) {
-    return;
-  }
+// Longest a near cache serves a copy of an entry without looking at the
+// shared cache again, and the first block size of its slots' arenas.
+static const int64_t kNearCacheTTLMs = 1000;
+static const size_t kNearCacheArenaSize = 512;
 
-  // SNMP message type (sequence).
-  if (*start != kSequenceType) {
-    return;
-  }
+// Resolution of the proxy's clock, and the least time between sweeps for
+// stale cache entries, however short the TTL.
+static const int64_t kClockTickMs = 1;
+static const int64_t kMinSweepIntervalMs = 1000;
 
-  // Sequence length.
-  ++start;
-  start += DecodeASN1Int(start, end, &length_);
-  if (length_ == 0) {
-    return;
-  }
+// Weight of the counts of changes a column was seen to make before the
+// latest refresh, lost at each refresh, and the fraction of the mean time
+// between changes to its values that entries of a column are kept for.
+static const double kVolatilityDecay = 0.125;
+static const double kTTLPerChangeInterval = 0.5;
 
-  // SNMP version (v2c).
-  if (memcmp(start, kSNMPv2cVersion.c_str(), kSNMPv2cVersion.size()) != 0) {
-    return;
-  }
+// Encoded names of snmpTrapOID.0, the notification a trap or inform is, and
+// snmpTrapAddress.0, the address of the agent that sent it through a relay.
+static const std::string kSNMPTrapOID(
+    "\x2b\x06\x01\x06\x03\x01\x01\x04\x01\x00", 10);
+static const std::string kSNMPTrapAddress(
+    "\x2b\x06\x01\x06\x03\x12\x01\x03\x00", 9);
 
-  // Community string type.
-  start += kSNMPv2cVersion.size();
-  if (*start != kStringType) {
-    return;
-  }
+// Notifications that invalidate what is cached of the backend sending them,
+// as SNMPProxy::TrapInvalidation, with dotted OIDs.
+struct KnownNotification {
+  std::string notification;
+  std::vector<std::string> prefixes;
+  bool per_interface;
+};
+static const std::vector<KnownNotification> kKnownNotifications = {
+    // coldStart and warmStart: anything may have changed.
+    {"1.3.6.1.6.3.1.1.5.1", {}, false},
+    {"1.3.6.1.6.3.1.1.5.2", {}, false},
+    // linkDown and linkUp: the ifTable and ifXTable rows of the interface.
+    {"1.3.6.1.6.3.1.1.5.3", {"1.3.6.1.2.1.2.2.1", "1.3.6.1.2.1.31.1.1.1"},
+     true},
+    {"1.3.6.1.6.3.1.1.5.4", {"1.3.6.1.2.1.2.2.1", "1.3.6.1.2.1.31.1.1.1"},
+     true},
+    // entConfigChange: the Entity MIB's tables.
+    {"1.3.6.1.2.1.47.2.0.1", {"1.3.6.1.2.1.47.1"}, false},
+    // ciscoConfigManEvent: anything the configuration sets.
+    {"1.3.6.1.4.1.9.9.43.2.0.1", {}, false},
+};
 
-  // Community string length.
-  ++start;
-  uint64_t community_length;
-  start += DecodeASN1Int(start, end, &community_length);
-  if (community_length == 0) {
-    return;
-  }
+// Bits in each cache partition's doorkeeper, which with four per key keep
+// false positives near 2% up to 100,000 keys per admission window.
+static const size_t kDoorkeeperBits = 1 << 20;
 
-  // Community string.
-  if (start + community_length > end) {
-    return;
-  }
-  community_.assign(start, community_length);
+// Slots that clients' rate limits and misses in flight are kept in.
+static const size_t kNumClientSlots = 1 << 16;
 
-  // Parse out community index.
-  const size_t community_index_pos_ = community_.find('@');
-  if (community_index_pos_ != std::string::npos) {
-    community_index_ = community_.substr(community_index_pos_);
-    community_.resize(community_index_pos_);
-    length_ -= community_index_.size();
-  }
+// Threads prefetching walks, and walks that may wait for one.
+static const unsigned int kNumPrefetchThreads = 4;
+static const size_t kPrefetchQueueSize = 1024;
 
-  // PDU type (GetRequest, GetNextRequest, GetResponse, or GetBulkRequest).
-  start += community_length;
-  if (start + 5 > end) {
-    return;
-  }
-  pdu_type_ = *start;
-  if (pdu_type_ != kGetRequestPDUType && pdu_type_ != kGetNextRequestPDUType &&
-      pdu_type_ != kGetResponsePDUType && pdu_type_ != kGetBulkRequestPDUType) {
-    return;
-  }
+// Slots that walk sessions are kept in, by client endpoint, and sessions kept
+// spare for walks that start on a cache hit.
+static const size_t kNumWalkSessionSlots = 1 << 16;
+static const size_t kNumSpareWalkSessions = 64;
 
-  // PDU length.
-  ++start;
-  start += DecodeASN1Int(start, end, &pdu_length_);
+// Room reserved in each string of a walk session. A request is at most
+// kRequestBufferSize bytes, and grows a little with the backend community.
+static const size_t kWalkSessionStringSize = 2 * kRequestBufferSize;
 
-  // Request ID type (integer).
-  if (*start != kIntegerType) {
-    return;
-  }
+// Max-repetitions of the GetBulk requests that fetch table snapshots.
+static const int64_t kSnapshotMaxRepetitions = 50;
 
-  // Request ID length (four bytes).
-  ++start;
-  if (*start != 0x04) {
-    return;
-  }
+// Most threads helping snapshot fetches walk their ranges, across fetches.
+static const unsigned int kMaxWalkThreads = 64;
 
-  // Request ID.
-  ++start;
-  request_id_ = *(uint32_t*)(start);
+// Fewest rows of a table to split each of its columns into ranges of, which
+// keeps the GetBulk chains walking them a few requests long at least.
+static const size_t kMinRowsPerRange = 4 * kSnapshotMaxRepetitions;
 
-  start += sizeof(request_id_);
-  data_.assign(start, end - start);
+// Most variable binding data in a response served from a snapshot, which
+// keeps it within a UDP datagram.
+static const size_t kMaxSnapshotResponseSize = 60000;
 
-  initialized_ = true;
+// Returns milliseconds on a clock that never jumps, and that all processes on
+// the host share.
+static int64_t MonotonicMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-bool SNMPProxy::SNMPSequence::initialized() const {
-  return initialized_;
+// Returns the slot of a client's rate limit and misses in flight.
+static size_t ClientSlot(uint32_t client_address) {
+  return HashBytes((const char*)&client_address, sizeof(client_address)) %
+         kNumClientSlots;
 }
 
-const std::string& SNMPProxy::SNMPSequence::community() const {
-  return community_;
+// Copies data into a string with room reserved for it, if it fits, so that
+// copying never allocates.
+static bool AssignReserved(const char* data, size_t size,
+                           std::string* output) {
+  if (size > output->capacity()) {
+    return false;
+  }
+  output->assign(data, size);
+  return true;
 }
 
-const std::string& SNMPProxy::SNMPSequence::community_index() const {
-  return community_index_;
-}
+// Returns the CPUs we may run on in each NUMA node that has any.
+static std::vector<std::vector<int>> NUMANodeCPUs() {
+  cpu_set_t allowed_cpus;
+  CPU_ZERO(&allowed_cpus);
+  sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus);
+  std::vector<std::vector<int>> node_cpus;
+  DIR* node_directory = opendir("/sys/devices/system/node");
+  if (node_directory != nullptr) {
+    while (dirent* entry = readdir(node_directory)) {
+      int node;
+      if (sscanf(entry->d_name, "node%d", &node) != 1) {
+        continue;
+      }
 
-uint8_t SNMPProxy::SNMPSequence::pdu_type() const {
-  return pdu_type_;
-}
+      // CPU lists look like "0-3,8-11".
+      std::ifstream cpu_list_file(std::string("/sys/devices/system/node/") +
+                                  entry->d_name + "/cpulist");
+      std::vector<int> cpus;
+      std::string range;
+      while (std::getline(cpu_list_file, range, ',')) {
+        int first, last;
+        const int num_fields = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (num_fields < 1) {
+          continue;
+        }
+        for (int cpu = first; cpu <= (num_fields == 2 ? last : first); ++cpu) {
+          if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed_cpus)) {
+            cpus.push_back(cpu);
+          }
+        }
+      }
+      if (!cpus.empty()) {
+        node_cpus.push_back(cpus);
+      }
+    }
+    closedir(node_directory);
+  }
 
-uint32_t SNMPProxy::SNMPSequence::request_id() const {
-  return request_id_;
+  // Without NUMA information, treat the machine as a single node.
+  if (node_cpus.empty()) {
+    node_cpus.resize(1);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &allowed_cpus)) {
+        node_cpus[0].push_back(cpu);
+      }
+    }
+  }
+  return node_cpus;
 }
 
-const std::string& SNMPProxy::SNMPSequence::data() const {
-  return data_;
+static void PinToCPUs(const std::vector<int>& cpus) {
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &cpu_set);
+  }
+  if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0) {
+    std::cerr << "Could not pin thread to CPU " << cpus[0] << "." << std::endl;
+  }
 }
 
-void SNMPProxy::SNMPSequence::set_community(const std::string& community) {
-  length_ -= (community_.size() + EncodeASN1Int(community_.size()).size() - 1);
-  length_ += (community.size() + EncodeASN1Int(community.size()).size() - 1);
-  community_ = community;
+// Appends a fixed-width integer to a cache handoff stream. Both ends of a
+// handoff run on the same host, so host byte order is used.
+template <typename T>
+static void AppendHandoffInt(T input, std::string* output) {
+  output->append((const char*)&input, sizeof(input));
 }
 
-void SNMPProxy::SNMPSequence::set_pdu_type(uint8_t pdu_type) {
-  pdu_type_ = pdu_type;
+template <typename T>
+static bool ReadHandoffInt(const char** start, const char* end, T* result) {
+  if (end - *start < (ptrdiff_t)sizeof(*result)) {
+    return false;
+  }
+  memcpy(result, *start, sizeof(*result));
+  *start += sizeof(*result);
+  return true;
 }
 
-void SNMPProxy::SNMPSequence::set_error(uint8_t error) {
-  data_[2] = error;
+template <typename String>
+static void AppendHandoffString(const String& input, std::string* output) {
+  AppendHandoffInt(uint32_t(input.size()), output);
+  output->append(input.data(), input.size());
 }
 
-void SNMPProxy::SNMPSequence::set_data(const std::string& data) {
-  length_ -= (data_.size() + EncodeASN1Int(pdu_length_).size() - 1);
-  length_ += data.size();
-  pdu_length_ -= data_.size();
-  pdu_length_ += data.size();
-  length_ += (EncodeASN1Int(pdu_length_).size() - 1);
-  data_ = data;
+template <typename String>
+static bool ReadHandoffString(const char** start, const char* end,
+                              String* result) {
+  uint32_t size;
+  if (!ReadHandoffInt(start, end, &size) || end - *start < size) {
+    return false;
+  }
+  result->assign(*start, size);
+  *start += size;
+  return true;
 }
 
-std::string SNMPProxy::SNMPSequence::Serialize() const {
-  std::string sequence;
-  sequence += kSequenceType;
-  sequence += EncodeASN1Int(length_);
-  sequence += kSNMPv2cVersion;
-  sequence += kStringType;
-  sequence += EncodeASN1Int(community_.size());
-  sequence += community_;
-  sequence += pdu_type_;
-  sequence += EncodeASN1Int(pdu_length_);
-  sequence += kIntegerType;
-  sequence += uint8_t(sizeof(request_id_));
-  sequence.append((const char*)&request_id_, sizeof(request_id_));
-  sequence += data_;
-  return sequence;
-}
+SNMPProxy::SNMPProxy(uint16_t port, const std::string& backend_community,
+                     int64_t backend_timeout_ms,
+                     unsigned int num_backend_retries,
+                     int64_t cache_ttl_ms,
+                     const std::string& handoff_path,
+                     double client_requests_per_sec, unsigned int client_burst,
+                     unsigned int max_client_misses, bool reject_over_limit,
+                     const std::string& xdp_interface, uint32_t xdp_queue,
+                     unsigned int num_workers, unsigned int queue_size,
+                     int64_t admission_window_ms,
+                     const std::vector<std::string>& always_cache_oids,
+                     unsigned int max_prefetch_depth,
+                     const std::vector<std::string>& snapshot_tables,
+                     unsigned int max_walks_per_backend,
+                     unsigned int near_cache_size,
+                     int64_t min_cache_ttl_ms, int64_t max_cache_ttl_ms,
+                     uint16_t trap_port,
+                     const std::string& trap_community,
+                     const std::vector<std::string>& trap_relays) :
+    port_(port), backend_community_(backend_community),
+    backend_timeout_ms_(backend_timeout_ms),
+    num_backend_retries_(num_backend_retries), cache_ttl_ms_(cache_ttl_ms),
+    handoff_path_(handoff_path),
+    client_requests_per_sec_(client_requests_per_sec),
+    client_burst_(client_burst), max_client_misses_(max_client_misses),
+    reject_over_limit_(reject_over_limit), xdp_interface_(xdp_interface),
+    xdp_queue_(xdp_queue), num_workers_(num_workers), queue_size_(queue_size),
+    admission_window_ms_(admission_window_ms),
+    always_cache_oids_(always_cache_oids),
+    max_prefetch_depth_(max_prefetch_depth),
+    snapshot_table_oids_(snapshot_tables),
+    max_walks_per_backend_(std::max(max_walks_per_backend, 1u)),
+    near_cache_size_(near_cache_size),
+    min_cache_ttl_ms_(min_cache_ttl_ms > 0 ? min_cache_ttl_ms : cache_ttl_ms),
+    max_cache_ttl_ms_(std::max(max_cache_ttl_ms > 0 ? max_cache_ttl_ms
+                                                    : cache_ttl_ms,
+                               min_cache_ttl_ms_)),
+    trap_port_(trap_port), trap_community_(trap_community),
+    trap_relays_(trap_relays),
+    num_stealable_tasks_(0), max_miss_allocations_(0),
+    clock_ms_(MonotonicMs()),
+    backend_endpoints_(new BackendEndpoints), backend_endpoints_version_(0),
+    client_full_times_(client_requests_per_sec > 0 ?
+                       new std::atomic<int64_t>[kNumClientSlots]() : nullptr),
+    client_misses_(max_client_misses > 0 ?
+                   new std::atomic<unsigned int>[kNumClientSlots]() :
+                   nullptr),
+    num_walk_threads_(0),
+    walk_sessions_(new std::unique_ptr<WalkSession>[kNumWalkSessionSlots]),
+    prefetch_queue_(kPrefetchQueueSize),
+    num_rejected_requests_(0),
+    num_dropped_requests_(0), handoff_pipe_{-1, -1} {}
 
-uint8_t SNMPProxy::SNMPSequence::DecodeASN1Int(
-    const char* start, const char* end, uint64_t* result){
-  if (!(*start & 0x80)) {
-    *result = *start;
-    return 1;
+bool SNMPProxy::Start() {
+  std::thread clock_thread(&SNMPProxy::TickClock, this);
+  clock_thread.detach();
+  for (const std::string& oid : always_cache_oids_) {
+    std::string prefix;
+    if (!SNMPSequence::EncodeOID(oid, &prefix)) {
+      std::cerr << "Invalid OID " << oid << "." << std::endl;
+      return false;
+    }
+    always_cache_prefixes_.push_back(prefix);
   }
-  uint8_t size = (*start & ~(0x80));
-  if (size > sizeof(result) || start + size > end) {
-    *result = 0;
-    return 0;
+  for (const std::string& oid : snapshot_table_oids_) {
+    std::string table;
+    if (!SNMPSequence::EncodeOID(oid, &table)) {
+      std::cerr << "Invalid OID " << oid << "." << std::endl;
+      return false;
+    }
+    snapshot_tables_.push_back(table);
   }
-  *result = 0;
-  for (uint8_t i = 0; i < size; ++i) {
-    ++start;
-    *result = *result << 8;
-    *result += *start;
+  SetUpNodes();
+  udp::socket socket(io_service_);
+  if (handoff_path_.empty() || !TakeOverSocket(&socket)) {
+    socket.open(udp::v4());
+    boost::system::error_code error;
+    socket.bind(udp::endpoint(udp::v4(), port_), error);
+    if (error) {
+      std::cerr << "Could not bind to port " << port_ << ": "
+                << error.message() << std::endl;
+      return false;
+    }
   }
-  return size + 1;
-}
 
-std::string SNMPProxy::SNMPSequence::EncodeASN1Int(uint64_t input) {
-  std::string result;
-  if (input < 0x80) {
-    result = uint8_t(input);
-    return result;
+  // Another process may be reading from the same socket after a handoff, so
+  // never block in a read that it might win.
+  socket.non_blocking(true);
+
+  boost::asio::local::stream_protocol::acceptor acceptor(io_service_);
+  if (!handoff_path_.empty()) {
+    boost::system::error_code error;
+    unlink(handoff_path_.c_str());
+    acceptor.open(boost::asio::local::stream_protocol());
+    acceptor.bind(boost::asio::local::stream_protocol::endpoint(handoff_path_),
+                  error);
+    if (!error) {
+      acceptor.listen(1, error);
+    }
+    if (error || pipe(handoff_pipe_) != 0) {
+      std::cerr << "Could not listen on " << handoff_path_ << ": "
+                << error.message() << std::endl;
+      return false;
+    }
+    std::thread handoff_thread(&SNMPProxy::HandOffSocket, this, &acceptor,
+                               &socket);
+    handoff_thread.detach();
   }
-  for (uint8_t i = sizeof(input); i > 0; --i) {
-    const uint8_t& byte = *((uint8_t*)&input + i - 1);
-    if (result.empty() && byte > 0) {
-      result = (i | 0x80); 
-    }       
-    if (!result.empty()) {
-      result += byte;
+
+  // The proxy handing off keeps the trap port until it exits, so share it
+  // with the one taking over in the meantime.
+  udp::socket trap_socket(io_service_);
+  if (trap_port_ != 0) {
+    // Anyone can send a trap, so only those that know the community are
+    // acted on.
+    if (trap_community_.empty()) {
+      std::cerr << "A trap community is required to receive traps."
+                << std::endl;
+      return false;
+    }
+    for (const std::string& relay : trap_relays_) {
+      boost::system::error_code error;
+      const boost::asio::ip::address address =
+          boost::asio::ip::address::from_string(relay, error);
+      if (error) {
+        std::cerr << "Invalid address " << relay << "." << std::endl;
+        return false;
+      }
+      trap_relay_addresses_.push_back(address);
+    }
+    for (const KnownNotification& known : kKnownNotifications) {
+      TrapInvalidation invalidation;
+      SNMPSequence::EncodeOID(known.notification,
+                              &invalidation.notification);
+      for (const std::string& oid : known.prefixes) {
+        invalidation.prefixes.emplace_back();
+        SNMPSequence::EncodeOID(oid, &invalidation.prefixes.back());
+      }
+      invalidation.per_interface = known.per_interface;
+      trap_invalidations_.push_back(invalidation);
+    }
+    trap_socket.open(udp::v4());
+    const int reuse_port = 1;
+    setsockopt(trap_socket.native_handle(), SOL_SOCKET, SO_REUSEPORT,
+               &reuse_port, sizeof(reuse_port));
+    boost::system::error_code error;
+    trap_socket.bind(udp::endpoint(udp::v4(), trap_port_), error);
+    if (error) {
+      std::cerr << "Could not bind to port " << trap_port_ << ": "
+                << error.message() << std::endl;
+      return false;
     }
+    std::thread trap_thread(&SNMPProxy::ListenForTraps, this, &trap_socket);
+    trap_thread.detach();
   }
-  return result;
-}
 
-SNMPProxy::CacheKey::CacheKey(const std::string& backend_host,
-                              const std::string& community,
-                              const std::string& community_index,
-                              uint8_t request_type,
-                              const std::string& request_data) :
-    backend_host_(backend_host), community_(community),
-    community_index_(community_index), request_type_(request_type),
-    request_data_(request_data) {}
+  // The XDP socket is opened before the workers are started, so that failing
+  // to open it doesn't leave their threads joinable.
+  std::unique_ptr<XDPSocket> xdp_socket;
+  if (!xdp_interface_.empty()) {
+    xdp_socket.reset(new XDPSocket(xdp_interface_, xdp_queue_, port_));
+    if (!xdp_socket->Open()) {
+      return false;
+    }
+  }
 
-bool SNMPProxy::CacheKey::operator==(const CacheKey& other) const {
-  return (backend_host_ == other.backend_host_ &&
-          community_ == other.community_ &&
-          community_index_ == other.community_index_ &&
-          request_type_ == other.request_type_ &&
-          request_data_ == other.request_data_);
-}
+  std::thread eviction_thread(&SNMPProxy::EvictStaleCacheEntries, this);
+  eviction_thread.detach();
+  if (max_prefetch_depth_ > 0) {
+    for (unsigned int i = 0; i < kNumPrefetchThreads; ++i) {
+      std::thread prefetch_thread(&SNMPProxy::PrefetchWalks, this);
+      prefetch_thread.detach();
+    }
+  }
+  for (unsigned int i = 0; i < num_workers_; ++i) {
+    workers_.emplace_back(new Worker);
+    workers_.back()->node = nodes_[i % nodes_.size()].get();
+  }
+  std::vector<std::thread> worker_threads;
+  for (unsigned int i = 0; i < num_workers_; ++i) {
+    Worker* worker = workers_[i].get();
+    const int cpu = worker->node->cpus[(i / nodes_.size()) %
+                                       worker->node->cpus.size()];
+    worker_threads.emplace_back(&SNMPProxy::Work, this, worker, cpu, &socket);
+  }
+
+  // Scratch memory for requests served by this thread, its connection to
+  // backends, and its near cache, made before any request can hit.
+  Arena arena;
+  BackendClient backend_client;
+  ThreadNearCache();
+  boost::array<char, 65536> packet;
+  std::vector<std::vector<Request>> batches(nodes_.size());
+  while (true) {
+    pollfd poll_fds[] = {{socket.native_handle(), POLLIN, 0},
+                         {handoff_pipe_[0], POLLIN, 0},
+                         {xdp_socket ? xdp_socket->fd() : -1, POLLIN, 0}};
+    if (poll(poll_fds, 3, -1) < 0) {
+      continue;
+    }
+    if (poll_fds[1].revents & POLLIN) {
+      StopWorkers(&worker_threads);
+      std::cout << "Handed off socket to new process. Exiting." << std::endl;
+      break;
+    }
+    if (poll_fds[2].revents & POLLIN) {
+      ServeXDPRequests(&socket, xdp_socket.get(), &arena, &backend_client);
+    }
+    if (!(poll_fds[0].revents & POLLIN)) {
+      continue;
+    }
+
+    // Drain a batch of datagrams before handing them to workers, so that each
+    // node's queue is updated once per batch.
+    for (size_t i = 0; i < kReceiveBatchSize; ++i) {
+      udp::endpoint remote_endpoint;
+      boost::system::error_code error;
+      const size_t packet_size =
+          socket.receive_from(boost::asio::buffer(packet), remote_endpoint, 0,
+                              error);
+      if (error == boost::asio::error::would_block) {
+        break;
+      }
+      if (error && error != boost::asio::error::message_size) {
+        throw boost::system::system_error(error);
+      }
+      Arena::Scope scope(&arena);
+      if (num_workers_ > 0 &&
+          DispatchRequest(packet.data(), packet.data() + packet_size,
+                          remote_endpoint, &batches)) {
+        continue;
+      }
 
-size_t SNMPProxy::CacheKey::Hash::operator()(const CacheKey& key) const {
-  return (std::hash<std::string>()(key.backend_host_) ^ 
-          std::hash<std::string>()(key.community_) ^
-          std::hash<std::string>()(key.community_index_) ^
-          std::hash<uint8_t>()(key.request_type_) ^
-          std::hash<std::string>()(key.request_data_));
+      const uint64_t num_allocations = NumThreadAllocations();
+      SNMPSequence snmp_sequence(packet.data(), packet.data() + packet_size);
+      bool cache_hit;
+      const ArenaString response = HandleRequest(
+          &snmp_sequence, remote_endpoint, &backend_client, &cache_hit);
+      if (!response.empty()) {
+        socket.send_to(boost::asio::buffer(response), remote_endpoint, 0,
+                       error);
+      }
+      CheckAllocations(cache_hit, NumThreadAllocations() - num_allocations);
+    }
+    EnqueueRequests(&batches);
+  }
+  return true;
 }
 
-SNMPProxy::CacheValue::CacheValue() {}
+void SNMPProxy::SetUpNodes() {
+  std::vector<std::vector<int>> node_cpus;
+  if (num_workers_ > 0) {
+    node_cpus = NUMANodeCPUs();
+  }
+  if (node_cpus.empty()) {
+    node_cpus.resize(1);
+  }
 
-SNMPProxy::CacheValue::CacheValue(const std::string& response_data) :
-    response_data_(response_data), time_(std::time(nullptr)) {}
+  // Only nodes that get a worker get a partition.
+  node_cpus.resize(std::min<size_t>(node_cpus.size(),
+                                    std::max(num_workers_, 1u)));
+  for (const std::vector<int>& cpus : node_cpus) {
+    // Memory is placed on the node of the thread that first touches it.
+    std::unique_ptr<Node> node;
+    std::thread set_up_thread([&] {
+      if (!cpus.empty()) {
+        PinToCPUs(cpus);
+      }
+      const unsigned int queue_size = num_workers_ > 0 ? queue_size_ : 1;
+      node.reset(new Node(queue_size));
+      node->cpus = cpus;
+      if (num_workers_ > 0) {
+        node->buffers.reset(new char[size_t(queue_size) * kRequestBufferSize]);
+        memset(node->buffers.get(), 0, size_t(queue_size) * kRequestBufferSize);
+        for (unsigned int i = 0; i < queue_size; ++i) {
+          node->free_buffers.TryEnqueue(node->buffers.get() +
+                                        size_t(i) * kRequestBufferSize);
+        }
+      }
+    });
+    set_up_thread.join();
+    nodes_.push_back(std::move(node));
+  }
+}
 
-std::time_t SNMPProxy::CacheValue::time() const {
-  return time_;
+size_t SNMPProxy::CachePartitionIndex(const ArenaString& backend_address) {
+  return StringHash()(backend_address) % nodes_.size();
 }
 
-const std::string& SNMPProxy::CacheValue::response_data() const {
-  return response_data_;
+SNMPProxy::Node* SNMPProxy::CachePartition(
+    const ArenaString& backend_address) {
+  return nodes_[CachePartitionIndex(backend_address)].get();
 }
 
-void SNMPProxy::TimeoutRead(boost::asio::ip::udp::socket& socket,
-                            std::condition_variable* cv) {
-  std::unique_lock<std::mutex> lock(mutex_);
-  if (cv->wait_for(lock, std::chrono::seconds(backend_timeout_sec_))) {
-    socket.cancel();
+SNMPProxy::NearCache* SNMPProxy::ThreadNearCache() {
+  if (near_cache_size_ == 0) {
+    return nullptr;
+  }
+  static thread_local std::unique_ptr<NearCache> near_cache;
+  if (!near_cache) {
+    near_cache.reset(new NearCache(near_cache_size_));
   }
+  return near_cache.get();
 }
 
-void SNMPProxy::Read(size_t bytes_transferred, size_t* response_size,
-                     std::condition_variable* cv) {
-  *response_size = bytes_transferred;
-  std::unique_lock<std::mutex> lock(mutex_);
-  cv->notify_all();
+SNMPProxy::Node::Node(unsigned int queue_size) :
+    doorkeeper(kDoorkeeperBits), doorkeeper_reset_time(MonotonicMs()),
+    requests(queue_size), free_buffers(queue_size), num_sleeping_workers(0),
+    stopping(false) {}
+
+bool SNMPProxy::DispatchRequest(const char* start, const char* end,
+                                const udp::endpoint& remote_endpoint,
+                                std::vector<std::vector<Request>>* batches) {
+  // The request is parsed once, here, and handed to a worker along with
+  // where its parts are.
+  SNMPSequence::Offsets offsets;
+  if (size_t(end - start) > kRequestBufferSize ||
+      !SNMPSequence::Parse(start, end, &offsets)) {
+    return false;
+  }
+
+  // Route by backend address if we have resolved it before, so that aliases
+  // land on the node whose partition holds their entries. Otherwise, the
+  // host name is as good a guess as any.
+  const ArenaString backend(start + offsets.community_offset,
+                            offsets.community_size);
+  udp::endpoint backend_endpoint;
+  ArenaString backend_address;
+  const size_t node_index = CachePartitionIndex(
+      FindBackend(backend, &backend_endpoint, &backend_address) ?
+          backend_address : backend);
+
+  // Every buffer has a place in the queue, so a request with a buffer is
+  // sure to be enqueued.
+  Request request = {nullptr, size_t(end - start), remote_endpoint, offsets};
+  if (!nodes_[node_index]->free_buffers.TryDequeue(&request.buffer)) {
+    ++num_dropped_requests_;
+    return true;
+  }
+  memcpy(request.buffer, start, request.size);
+  (*batches)[node_index].push_back(request);
+  return true;
 }
 
-std::string SNMPProxy::GetResponse(const std::string& backend_host,
-                                   const SNMPSequence& snmp_request) {
-  CacheKey key(backend_host, snmp_request.community(),
-               snmp_request.community_index(), snmp_request.pdu_type(),
-               snmp_request.data());
-  {
-    std::lock_guard<std::mutex> lock(mutex_);
-    auto cache_entry = cache_.find(key);
-    if (cache_entry != cache_.end()) {
-      // Stale cache entry. Evict it and fall through to the backend.
-      if (std::time(nullptr) > cache_entry->second.time() + cache_ttl_sec_) {
-        cache_.erase(cache_entry);
+void SNMPProxy::EnqueueRequests(std::vector<std::vector<Request>>* batches) {
+  for (size_t i = 0; i < batches->size(); ++i) {
+    std::vector<Request>& batch = (*batches)[i];
+    if (batch.empty()) {
+      continue;
+    }
+    Node* node = nodes_[i].get();
+    node->requests.TryEnqueueBatch(batch.data(), batch.size());
+
+    // Pairs with the fence in Work(), so that either we see a worker going to
+    // sleep, or it sees our requests.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (node->num_sleeping_workers.load() > 0) {
+      std::lock_guard<std::mutex> lock(node->requests_mutex);
+      if (batch.size() == 1) {
+        node->requests_cv.notify_one();
       } else {
-        // Fresh cache entry. Serve it.
-        SNMPSequence snmp_response(snmp_request);
-        snmp_response.set_community(backend_host);
-        snmp_response.set_pdu_type(kGetResponsePDUType);
-        snmp_response.set_data(cache_entry->second.response_data());
-        return snmp_response.Serialize();
+        node->requests_cv.notify_all();
       }
     }
+    batch.clear();
   }
-  udp::resolver resolver(io_service_);
-  udp::resolver::query query(udp::v4(), backend_host, "snmp");
-  udp::endpoint remote_endpoint = *resolver.resolve(query);
-  udp::socket socket(io_service_);
-  socket.open(udp::v4());
+}
 
-  unsigned int num_retries = 0;
-  boost::array<char, 65536> response;
-  udp::endpoint local_endpoint;
-  size_t response_size = 0;
-  do {
-    io_service_.reset();
-    socket.send_to(boost::asio::buffer(snmp_request.Serialize()),
-                                       remote_endpoint);
-    std::condition_variable cv;
-    std::thread read_timeout_thread(
-        std::bind(&SNMPProxy::TimeoutRead, this, boost::ref(socket), &cv));
-    socket.async_receive_from(
-        boost::asio::buffer(response), local_endpoint,
-        boost::bind(&SNMPProxy::Read, this,
-                    boost::asio::placeholders::bytes_transferred,
-                    &response_size, &cv));
-    io_service_.run();
-    read_timeout_thread.join();
-    ++num_retries;
-  } while (num_retries <= num_backend_retries_ && response_size == 0);
+void SNMPProxy::Work(Worker* worker, int cpu, udp::socket* socket) {
+  PinToCPUs(std::vector<int>(1, cpu));
+  Node* node = worker->node;
+  std::minstd_rand random(cpu + 1);
+  Arena arena;
+  BackendClient backend_client;
+  ThreadNearCache();
+  Request requests[kWorkerBatchSize];
+  while (true) {
+    Request request;
+    Node* request_node = node;
+    if (!PopTask(worker, &request)) {
+      size_t num_requests =
+          node->requests.TryDequeueBatch(requests, kWorkerBatchSize);
+      if (num_requests > 1) {
+        num_requests = ServeCacheHits(requests, num_requests, node, &arena,
+                                      socket);
+        if (num_requests == 0) {
+          continue;
+        }
+      }
+      if (num_requests > 0) {
+        // Serve the first now, and leave the rest where they can be stolen.
+        request = requests[0];
+        PushTasks(worker, requests + 1, num_requests - 1);
+      } else if (!StealTask(worker, &random, &request, &request_node)) {
+        std::unique_lock<std::mutex> lock(node->requests_mutex);
+        ++node->num_sleeping_workers;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        node->requests_cv.wait(lock, [this, node] {
+          return !node->requests.Empty() || num_stealable_tasks_.load() > 0 ||
+                 node->stopping;
+        });
+        --node->num_sleeping_workers;
+        if (node->stopping && node->requests.Empty()) {
+          return;
+        }
+        continue;
+      }
+    }
 
-  // We didn't get a response. Cache and serve an unavailable error.
-  if (response_size == 0) {
+    Arena::Scope scope(&arena);
+    const uint64_t num_allocations = NumThreadAllocations();
+    SNMPSequence snmp_sequence(request.buffer, request.buffer + request.size,
+                               request.offsets);
+    bool cache_hit;
+    const ArenaString response =
+        HandleRequest(&snmp_sequence, request.remote_endpoint,
+                      &backend_client, &cache_hit);
+    if (!response.empty()) {
+      boost::system::error_code error;
+      socket->send_to(boost::asio::buffer(response), request.remote_endpoint,
+                      0, error);
+    }
+    CheckAllocations(cache_hit, NumThreadAllocations() - num_allocations);
+    request_node->free_buffers.TryEnqueue(request.buffer);
+  }
+}
+
+size_t SNMPProxy::ServeCacheHits(Request* requests, size_t num_requests,
+                                 Node* node, Arena* arena,
+                                 udp::socket* socket) {
+  Arena::Scope scope(arena);
+  const uint64_t num_allocations = NumThreadAllocations();
+
+  // Nothing is done to a request on the way to its key that would have to be
+  // undone if it misses, since misses start over on the usual path.
+  ArenaVector<BatchedRequest> batch;
+  batch.reserve(num_requests);
+  for (size_t i = 0; i < num_requests; ++i) {
+    const SNMPSequence snmp_sequence(requests[i].buffer,
+                                     requests[i].buffer + requests[i].size,
+                                     requests[i].offsets);
+    switch (snmp_sequence.pdu_type()) {
+      case kGetRequestPDUType:
+        KeyBatchedRequest<GetPDU>(snmp_sequence, i, &batch);
+        break;
+      case kGetNextRequestPDUType:
+        KeyBatchedRequest<GetNextPDU>(snmp_sequence, i, &batch);
+        break;
+      case kGetBulkRequestPDUType:
+        KeyBatchedRequest<GetBulkPDU>(snmp_sequence, i, &batch);
+        break;
+    }
+  }
+
+  // Copies in the thread's near cache are served first.
+  NearCache* near_cache = ThreadNearCache();
+  const int64_t current_time = NowMs();
+  auto serve = [](const CacheValue& cache_value,
+                  BatchedRequest* batched_request) {
+    if (batched_request->answers(cache_value,
+                                 batched_request->request_fields)) {
+      batched_request->response = batched_request->serve(
+          cache_value, batched_request->backend_host,
+          batched_request->snmp_request, batched_request->request_fields,
+          batched_request->varbind_order);
+      batched_request->hit = true;
+    }
+  };
+  if (near_cache != nullptr) {
+    for (BatchedRequest& batched_request : batch) {
+      const CacheValue* cache_value =
+          near_cache->Find(batched_request.key, current_time);
+      if (cache_value != nullptr) {
+        serve(*cache_value, &batched_request);
+      }
+    }
+  }
+
+  // Look up the rest of the keys of each partition together, and serve
+  // fresh entries while its lock is held, like GetResponse() does. Stale
+  // entries, and keys being prefetched, are left to the usual path.
+  ArenaVector<const CacheKey*> keys;
+  ArenaVector<uint32_t> slots(batch.size());
+  for (const std::unique_ptr<Node>& partition : nodes_) {
+    keys.clear();
+    for (const BatchedRequest& batched_request : batch) {
+      if (!batched_request.hit &&
+          batched_request.partition == partition.get()) {
+        keys.push_back(&batched_request.key);
+      }
+    }
+    if (keys.empty()) {
+      continue;
+    }
+    std::lock_guard<std::mutex> lock(partition->cache_mutex);
+    const Cache& cache = partition->cache;
+    cache.Find(keys.data(), keys.size(), slots.data());
+    size_t key_index = 0;
+    for (BatchedRequest& batched_request : batch) {
+      if (batched_request.hit ||
+          batched_request.partition != partition.get()) {
+        continue;
+      }
+      const uint32_t slot = slots[key_index++];
+      if (slot == Cache::kNoSlot ||
+          current_time > cache.expiry_time(slot) ||
+          (!partition->keys_prefetching.empty() &&
+           partition->keys_prefetching.count(batched_request.key.hash()) >
+               0)) {
+        continue;
+      }
+      const CacheValue& cache_value = cache.entry(slot)->second;
+      serve(cache_value, &batched_request);
+      if (batched_request.hit && near_cache != nullptr) {
+        near_cache->Insert(batched_request.key, cache_value, cache,
+                           std::min(cache.expiry_time(slot),
+                                    current_time + kNearCacheTTLMs));
+      }
+    }
+  }
+
+  // Admit and answer the hits as ServeRequest() would have.
+  bool served = false;
+  for (BatchedRequest& batched_request : batch) {
+    if (!batched_request.hit) {
+      continue;
+    }
+    Request* request = &requests[batched_request.index];
+    const udp::endpoint& remote_endpoint = request->remote_endpoint;
+    ArenaString response;
+    if (!AdmitRequest(remote_endpoint.address().to_v4().to_ulong())) {
+      if (reject_over_limit_) {
+        response = ErrorResponse(batched_request.backend_host,
+                                 batched_request.snmp_request);
+      }
+    } else {
+      std::cout << "Got SNMPv2c request from " << remote_endpoint.address()
+                << ":" << remote_endpoint.port()
+                << " (community=" << batched_request.backend_host
+                << batched_request.snmp_request.community_index() << ")."
+                << std::endl;
+      response = batched_request.response;
+      if (batched_request.walk && max_prefetch_depth_ > 0) {
+        TrackWalk(remote_endpoint, batched_request.backend_host,
+                  batched_request.snmp_request,
+                  batched_request.request_fields, response,
+                  std::shared_ptr<const TableSnapshot>(), true);
+      }
+    }
+    if (!response.empty()) {
+      boost::system::error_code error;
+      socket->send_to(boost::asio::buffer(response), remote_endpoint, 0,
+                      error);
+    }
+    node->free_buffers.TryEnqueue(request->buffer);
+    request->buffer = nullptr;
+    served = true;
+  }
+  if (served) {
+    CheckAllocations(true, NumThreadAllocations() - num_allocations);
+  }
+
+  size_t num_misses = 0;
+  for (size_t i = 0; i < num_requests; ++i) {
+    if (requests[i].buffer != nullptr) {
+      requests[num_misses++] = requests[i];
+    }
+  }
+  return num_misses;
+}
+
+void SNMPProxy::PushTasks(Worker* worker, const Request* requests,
+                          size_t count) {
+  if (count == 0) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(worker->tasks_mutex);
+    worker->tasks.insert(worker->tasks.end(), requests, requests + count);
+    num_stealable_tasks_ += count;
+  }
+
+  // Pairs with the fence in Work(), like in EnqueueRequests(). A sleeping
+  // worker on the same node is woken first, as it would steal them first.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  for (bool same_node : {true, false}) {
+    for (const std::unique_ptr<Node>& node : nodes_) {
+      if ((node.get() == worker->node) == same_node &&
+          node->num_sleeping_workers.load() > 0) {
+        std::lock_guard<std::mutex> lock(node->requests_mutex);
+        node->requests_cv.notify_one();
+        return;
+      }
+    }
+  }
+}
+
+bool SNMPProxy::PopTask(Worker* worker, Request* request) {
+  std::lock_guard<std::mutex> lock(worker->tasks_mutex);
+  if (worker->tasks.empty()) {
+    return false;
+  }
+  *request = worker->tasks.back();
+  worker->tasks.pop_back();
+  --num_stealable_tasks_;
+  return true;
+}
+
+bool SNMPProxy::StealTask(Worker* thief, std::minstd_rand* random,
+                          Request* request, Node** node) {
+  if (num_stealable_tasks_.load() == 0) {
+    return false;
+  }
+
+  // Start at a random victim so that thieves spread out, then try the rest.
+  // Workers on the thief's node go first, since their requests' buffers and
+  // the cache partition they mostly hit are in its memory, and other nodes'
+  // only once those have none.
+  const size_t first_victim = (*random)() % workers_.size();
+  for (bool same_node : {true, false}) {
+    for (size_t i = 0; i < workers_.size(); ++i) {
+      Worker* victim = workers_[(first_victim + i) % workers_.size()].get();
+      if (victim == thief || (victim->node == thief->node) != same_node) {
+        continue;
+      }
+      std::lock_guard<std::mutex> lock(victim->tasks_mutex);
+      if (!victim->tasks.empty()) {
+        *request = victim->tasks.front();
+        victim->tasks.pop_front();
+        --num_stealable_tasks_;
+        *node = victim->node;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void SNMPProxy::StopWorkers(std::vector<std::thread>* worker_threads) {
+  for (const std::unique_ptr<Node>& node : nodes_) {
+    std::lock_guard<std::mutex> lock(node->requests_mutex);
+    node->stopping = true;
+    node->requests_cv.notify_all();
+  }
+  for (std::thread& worker_thread : *worker_threads) {
+    worker_thread.join();
+  }
+}
+
+ArenaString SNMPProxy::HandleRequest(SNMPSequence* snmp_sequence,
+                                     const udp::endpoint& remote_endpoint,
+                                     BackendClient* backend_client,
+                                     bool* cache_hit) {
+  *cache_hit = false;
+  if (!snmp_sequence->initialized()) {
+    return ArenaString();
+  }
+
+  // Each request PDU type has a path of its own. Anything else, including
+  // responses, is dropped.
+  switch (snmp_sequence->pdu_type()) {
+    case kGetRequestPDUType:
+      return ServeRequest<GetPDU>(snmp_sequence, remote_endpoint,
+                                  backend_client, cache_hit);
+    case kGetNextRequestPDUType:
+      return ServeRequest<GetNextPDU>(snmp_sequence, remote_endpoint,
+                                      backend_client, cache_hit);
+    case kGetBulkRequestPDUType:
+      return ServeRequest<GetBulkPDU>(snmp_sequence, remote_endpoint,
+                                      backend_client, cache_hit);
+    default:
+      return ArenaString();
+  }
+}
+
+template <typename PDU>
+ArenaString SNMPProxy::ServeRequest(SNMPSequence* snmp_request,
+                                    const udp::endpoint& remote_endpoint,
+                                    BackendClient* backend_client,
+                                    bool* cache_hit) {
+  const ArenaString backend_host = snmp_request->community();
+  const uint32_t client_address = remote_endpoint.address().to_v4().to_ulong();
+  if (!AdmitRequest(client_address)) {
+    return reject_over_limit_ ? ErrorResponse(backend_host, *snmp_request) :
+                                ArenaString();
+  }
+
+  // Printing the endpoint itself would format it into a temporary stream.
+  std::cout << "Got SNMPv2c request from " << remote_endpoint.address() << ":"
+            << remote_endpoint.port()
+            << " (community=" << snmp_request->community()
+            << snmp_request->community_index() << ")." << std::endl;
+
+  UseBackendCommunity(snmp_request);
+
+  // Requests whose variable bindings we can't make sense of are passed
+  // through, and cached, as they are.
+  SNMPSequence::Fields request_fields;
+  if (!SNMPSequence::ParseData(snmp_request->data(), &request_fields)) {
+    return GetResponse<OpaquePDU>(backend_host, client_address, *snmp_request,
+                                  request_fields, backend_client, cache_hit,
+                                  false);
+  }
+  ArenaString response;
+  std::shared_ptr<const TableSnapshot> snapshot;
+  if (!PDU::kWalk ||
+      !ServeFromSnapshot(remote_endpoint, backend_host, client_address,
+                         *snmp_request, request_fields,
+                         PDU::Repetitions(request_fields), backend_client,
+                         &response, &snapshot, cache_hit)) {
+    response = GetResponse<PDU>(backend_host, client_address, *snmp_request,
+                                request_fields, backend_client, cache_hit,
+                                false);
+  }
+  if (PDU::kWalk && (max_prefetch_depth_ > 0 || !snapshot_tables_.empty())) {
+    TrackWalk(remote_endpoint, backend_host, *snmp_request, request_fields,
+              response, snapshot, *cache_hit);
+  }
+  return response;
+}
+
+template <typename PDU>
+void SNMPProxy::KeyBatchedRequest(const SNMPSequence& snmp_sequence,
+                                  size_t index,
+                                  ArenaVector<BatchedRequest>* batch) {
+  if (PDU::kWalk && !snapshot_tables_.empty()) {
+    return;
+  }
+  SNMPSequence snmp_request(snmp_sequence);
+  UseBackendCommunity(&snmp_request);
+  // Backends that have yet to be resolved are left to the usual path too.
+  SNMPSequence::Fields request_fields;
+  udp::endpoint backend_endpoint;
+  ArenaString backend_address;
+  if (!SNMPSequence::ParseData(snmp_request.data(), &request_fields) ||
+      !FindBackend(snmp_sequence.community(), &backend_endpoint,
+                   &backend_address)) {
+    return;
+  }
+  SNMPSequence canonical_request(snmp_request);
+  ArenaVector<size_t> varbind_order;
+  const CacheKey key = KeyRequest<PDU>(snmp_request, request_fields,
+                                       backend_address, &canonical_request,
+                                       &varbind_order);
+  Node* partition = CachePartition(key.backend_address());
+  batch->push_back(BatchedRequest{
+      snmp_request, request_fields, snmp_sequence.community(), varbind_order,
+      key, partition, PDU::kWalk, &PDU::Answers, &ServeCacheValue<PDU>, index,
+      false, ArenaString()});
+}
+
+void SNMPProxy::UseBackendCommunity(SNMPSequence* snmp_request) const {
+  ArenaString community(backend_community_.data(), backend_community_.size());
+  community += snmp_request->community_index();
+  snmp_request->set_community(community);
+}
+
+void SNMPProxy::ServeXDPRequests(udp::socket* socket, XDPSocket* xdp_socket,
+                                 Arena* arena,
+                                 BackendClient* backend_client) {
+  XDPSocket::Datagram datagram;
+  while (xdp_socket->Receive(&datagram)) {
+    Arena::Scope scope(arena);
+    const uint64_t num_allocations = NumThreadAllocations();
+    SNMPSequence snmp_sequence(datagram.payload,
+                               datagram.payload + datagram.payload_size);
+    bool cache_hit;
+    const ArenaString response =
+        HandleRequest(&snmp_sequence, datagram.remote_endpoint,
+                      backend_client, &cache_hit);
+
+    // Responses that took a backend query, or that don't fit in a frame, go
+    // out through the kernel like everything else.
+    if (!response.empty() &&
+        (!cache_hit ||
+         !xdp_socket->Send(datagram, response.data(), response.size()))) {
+      boost::system::error_code error;
+      socket->send_to(boost::asio::buffer(response), datagram.remote_endpoint,
+                      0, error);
+    }
+    xdp_socket->Release(datagram);
+    CheckAllocations(cache_hit, NumThreadAllocations() - num_allocations);
+  }
+}
+
+void SNMPProxy::CheckAllocations(bool cache_hit, uint64_t num_allocations) {
+  if (!kCountAllocations) {
+    return;
+  }
+
+  // The first requests a thread serves may find the cache partition's
+  // buckets, or the thread's own state, still to be allocated.
+  static thread_local uint64_t num_requests = 0;
+  if (++num_requests <= kAllocationWarmUpRequests) {
+    return;
+  }
+  if (cache_hit && num_allocations > 0) {
+    std::cerr << "Cache hit allocated " << num_allocations << " times."
+              << std::endl;
+    abort();
+  }
+  if (!cache_hit) {
+    uint64_t max_miss_allocations = max_miss_allocations_.load();
+    while (num_allocations > max_miss_allocations) {
+      if (max_miss_allocations_.compare_exchange_weak(max_miss_allocations,
+                                                      num_allocations)) {
+        std::cout << "Miss allocated " << num_allocations
+                  << " times, the most so far." << std::endl;
+        break;
+      }
+    }
+  }
+}
+
+SNMPProxy::SNMPSequence::SNMPSequence(const char* start, const char* end) :
+    initialized_(false) {
+  Offsets offsets;
+  if (Parse(start, end, &offsets)) {
+    Assign(start, end, offsets);
+  }
+}
+
+SNMPProxy::SNMPSequence::SNMPSequence(const char* start, const char* end,
+                                      const Offsets& offsets) :
+    initialized_(false) {
+  Assign(start, end, offsets);
+}
+
+bool SNMPProxy::SNMPSequence::Parse(const char* start, const char* end,
+                                    Offsets* offsets) {
+  const char* const payload = start;
+  if (end - start < 7) {
+    return false;
+  }
+
+  // SNMP message type (sequence).
+  if (*start != kSequenceType) {
+    return false;
+  }
+
+  // Sequence length.
+  ++start;
+  start += DecodeASN1Int(start, end, &offsets->length);
+  if (offsets->length == 0) {
+    return false;
+  }
+
+  // SNMP version (v2c).
+  if (memcmp(start, kSNMPv2cVersion.c_str(), kSNMPv2cVersion.size()) != 0) {
+    return false;
+  }
+
+  // Community string type.
+  start += kSNMPv2cVersion.size();
+  if (*start != kStringType) {
+    return false;
+  }
+
+  // Community string length.
+  ++start;
+  uint64_t community_length;
+  start += DecodeASN1Int(start, end, &community_length);
+  if (community_length == 0) {
+    return false;
+  }
+
+  // Community string, and the community index in it.
+  if (start + community_length > end) {
+    return false;
+  }
+  const char* community_index =
+      (const char*)memchr(start, '@', community_length);
+  offsets->community_offset = start - payload;
+  offsets->community_size = community_index == nullptr ?
+                                community_length : community_index - start;
+  offsets->community_index_size =
+      community_length - offsets->community_size;
+  offsets->length -= offsets->community_index_size;
+
+  // PDU type (GetRequest, GetNextRequest, GetResponse, or GetBulkRequest).
+  start += community_length;
+  if (start + 5 > end) {
+    return false;
+  }
+  offsets->pdu_type = *start;
+  if (offsets->pdu_type != kGetRequestPDUType &&
+      offsets->pdu_type != kGetNextRequestPDUType &&
+      offsets->pdu_type != kGetResponsePDUType &&
+      offsets->pdu_type != kGetBulkRequestPDUType) {
+    return false;
+  }
+
+  // PDU length.
+  ++start;
+  start += DecodeASN1Int(start, end, &offsets->pdu_length);
+
+  // Request ID type (integer).
+  if (*start != kIntegerType) {
+    return false;
+  }
+
+  // Request ID length (four bytes).
+  ++start;
+  if (*start != 0x04) {
+    return false;
+  }
+
+  // Request ID.
+  ++start;
+  if (end - start < (ptrdiff_t)sizeof(offsets->request_id)) {
+    return false;
+  }
+  offsets->request_id = *(uint32_t*)(start);
+
+  start += sizeof(offsets->request_id);
+  offsets->data_offset = start - payload;
+  return true;
+}
+
+void SNMPProxy::SNMPSequence::Assign(const char* start, const char* end,
+                                     const Offsets& offsets) {
+  length_ = offsets.length;
+  community_.assign(start + offsets.community_offset, offsets.community_size);
+  community_index_.assign(
+      start + offsets.community_offset + offsets.community_size,
+      offsets.community_index_size);
+  pdu_type_ = offsets.pdu_type;
+  pdu_length_ = offsets.pdu_length;
+  request_id_ = offsets.request_id;
+  data_.assign(start + offsets.data_offset,
+               end - start - offsets.data_offset);
+  initialized_ = true;
+}
+
+bool SNMPProxy::SNMPSequence::ParseNotification(const char* start,
+                                                const char* end,
+                                                ArenaString* community,
+                                                size_t* pdu_type_offset,
+                                                uint8_t* pdu_type,
+                                                ArenaString* data) {
+  const char* const payload = start;
+  uint8_t type;
+  uint64_t length;
+  if (!DecodeASN1TypeAndLength(&start, end, &type, &length) ||
+      type != kSequenceType ||
+      end - start < (ptrdiff_t)kSNMPv2cVersion.size() ||
+      memcmp(start, kSNMPv2cVersion.c_str(), kSNMPv2cVersion.size()) != 0) {
+    return false;
+  }
+  start += kSNMPv2cVersion.size();
+  if (!DecodeASN1TypeAndLength(&start, end, &type, &length) ||
+      type != kStringType || end - start < (ptrdiff_t)length) {
+    return false;
+  }
+  community->assign(start, length);
+  start += length;
+  *pdu_type_offset = start - payload;
+  if (!DecodeASN1TypeAndLength(&start, end, pdu_type, &length) ||
+      (*pdu_type != kInformRequestPDUType &&
+       *pdu_type != kSNMPv2TrapPDUType)) {
+    return false;
+  }
+
+  // Unlike requests, notifications come from all sorts of agents, which
+  // encode request IDs in as few bytes as they like.
+  if (!DecodeASN1TypeAndLength(&start, end, &type, &length) ||
+      type != kIntegerType) {
+    return false;
+  }
+  start += length;
+  data->assign(start, end - start);
+  return true;
+}
+
+bool SNMPProxy::SNMPSequence::initialized() const {
+  return initialized_;
+}
+
+const ArenaString& SNMPProxy::SNMPSequence::community() const {
+  return community_;
+}
+
+const ArenaString& SNMPProxy::SNMPSequence::community_index() const {
+  return community_index_;
+}
+
+uint8_t SNMPProxy::SNMPSequence::pdu_type() const {
+  return pdu_type_;
+}
+
+uint32_t SNMPProxy::SNMPSequence::request_id() const {
+  return request_id_;
+}
+
+const ArenaString& SNMPProxy::SNMPSequence::data() const {
+  return data_;
+}
+
+void SNMPProxy::SNMPSequence::set_community(const ArenaString& community) {
+  length_ -= (community_.size() + EncodeASN1Int(community_.size()).size() - 1);
+  length_ += (community.size() + EncodeASN1Int(community.size()).size() - 1);
+  community_ = community;
+}
+
+void SNMPProxy::SNMPSequence::set_pdu_type(uint8_t pdu_type) {
+  pdu_type_ = pdu_type;
+}
+
+void SNMPProxy::SNMPSequence::set_request_id(uint32_t request_id) {
+  request_id_ = request_id;
+}
+
+void SNMPProxy::SNMPSequence::set_error(uint8_t error) {
+  data_[2] = error;
+}
+
+void SNMPProxy::SNMPSequence::set_data(const ArenaString& data) {
+  length_ -= (data_.size() + EncodeASN1Int(pdu_length_).size() - 1);
+  length_ += data.size();
+  pdu_length_ -= data_.size();
+  pdu_length_ += data.size();
+  length_ += (EncodeASN1Int(pdu_length_).size() - 1);
+  data_ = data;
+}
+
+ArenaString SNMPProxy::SNMPSequence::Serialize() const {
+  ArenaString sequence;
+  sequence += kSequenceType;
+  sequence += EncodeASN1Int(length_);
+  sequence.append(kSNMPv2cVersion.data(), kSNMPv2cVersion.size());
+  sequence += kStringType;
+  sequence += EncodeASN1Int(community_.size());
+  sequence += community_;
+  sequence += pdu_type_;
+  sequence += EncodeASN1Int(pdu_length_);
+  sequence += kIntegerType;
+  sequence += uint8_t(sizeof(request_id_));
+  sequence.append((const char*)&request_id_, sizeof(request_id_));
+  sequence += data_;
+  return sequence;
+}
+
+bool SNMPProxy::SNMPSequence::ParseData(const ArenaString& data,
+                                        Fields* fields) {
+  const char* start = data.data();
+  const char* end = data.data() + data.size();
+  uint8_t type;
+  uint64_t length;
+
+  // Error status (or non-repeaters).
+  if (!DecodeASN1TypeAndLength(&start, end, &type, &length) ||
+      type != kIntegerType ||
+      !DecodeASN1Integer(start, length, &fields->error_status)) {
+    return false;
+  }
+  start += length;
+
+  // Error index (or max-repetitions).
+  fields->error_index_offset = start - data.data();
+  if (!DecodeASN1TypeAndLength(&start, end, &type, &length) ||
+      type != kIntegerType ||
+      !DecodeASN1Integer(start, length, &fields->error_index)) {
+    return false;
+  }
+  start += length;
+
+  // Variable binding list.
+  fields->varbind_list_offset = start - data.data();
+  if (!DecodeASN1TypeAndLength(&start, end, &type, &length) ||
+      type != kSequenceType) {
+    return false;
+  }
+  end = start + length;
+  fields->varbinds.clear();
+  while (start < end) {
+    const char* varbind = start;
+    if (!DecodeASN1TypeAndLength(&start, end, &type, &length) ||
+        type != kSequenceType) {
+      return false;
+    }
+    start += length;
+    fields->varbinds.emplace_back(varbind - data.data(), start - varbind);
+  }
+  return true;
+}
+
+bool SNMPProxy::SNMPSequence::VarbindName(
+    const ArenaString& data, const std::pair<size_t, size_t>& varbind,
+    const char** name, uint64_t* size, uint8_t* value_type) {
+  const char* start = data.data() + varbind.first;
+  const char* end = start + varbind.second;
+  uint8_t type;
+  if (!DecodeASN1TypeAndLength(&start, end, &type, size) ||
+      type != kSequenceType ||
+      !DecodeASN1TypeAndLength(&start, end, &type, size) ||
+      type != kObjectIdentifierType) {
+    return false;
+  }
+  *name = start;
+  if (value_type != nullptr) {
+    *value_type = start + *size < end ? uint8_t(start[*size]) : 0;
+  }
+  return true;
+}
+
+bool SNMPProxy::SNMPSequence::VarbindValue(
+    const ArenaString& data, const std::pair<size_t, size_t>& varbind,
+    const char** value, uint64_t* size, uint8_t* value_type) {
+  const char* name;
+  uint64_t name_size;
+  if (!VarbindName(data, varbind, &name, &name_size)) {
+    return false;
+  }
+  const char* start = name + name_size;
+  if (!DecodeASN1TypeAndLength(&start,
+                               data.data() + varbind.first + varbind.second,
+                               value_type, size)) {
+    return false;
+  }
+  *value = start;
+  return true;
+}
+
+bool SNMPProxy::SNMPSequence::EncodeOID(const std::string& dotted_oid,
+                                        std::string* result) {
+  std::vector<uint64_t> arcs;
+  const char* position = dotted_oid.c_str();
+  if (*position == '.') {
+    ++position;
+  }
+  while (*position != '\0') {
+    if (!isdigit(*position)) {
+      return false;
+    }
+    char* arc_end;
+    arcs.push_back(strtoull(position, &arc_end, 10));
+    position = arc_end;
+    if (*position == '.' && *++position == '\0') {
+      return false;
+    }
+  }
+  if (arcs.size() < 2 || arcs[0] > 2 || (arcs[0] < 2 && arcs[1] >= 40)) {
+    return false;
+  }
+
+  // The first two arcs share a subidentifier.
+  arcs[1] += arcs[0] * 40;
+  result->clear();
+  for (size_t i = 1; i < arcs.size(); ++i) {
+    AppendSubidentifier(arcs[i], result);
+  }
+  return true;
+}
+
+void SNMPProxy::SNMPSequence::AppendSubidentifier(uint64_t subidentifier,
+                                                  std::string* oid) {
+  // Base 128, most significant digit first, with the high bit set on all but
+  // the last.
+  char digits[10];
+  size_t num_digits = 0;
+  do {
+    digits[num_digits] = (subidentifier & 0x7f) | (num_digits > 0 ? 0x80 : 0);
+    ++num_digits;
+    subidentifier >>= 7;
+  } while (subidentifier > 0);
+  while (num_digits > 0) {
+    *oid += digits[--num_digits];
+  }
+}
+
+uint64_t SNMPProxy::SNMPSequence::DecodeSubidentifier(const char** start,
+                                                      const char* end) {
+  uint64_t result = 0;
+  while (*start < end) {
+    const uint8_t digit = **start;
+    ++*start;
+    result = (result << 7) | (digit & 0x7f);
+    if (!(digit & 0x80)) {
+      break;
+    }
+  }
+  return result;
+}
+
+int SNMPProxy::SNMPSequence::CompareOIDs(const char* a, size_t a_size,
+                                         const char* b, size_t b_size) {
+  const char* a_end = a + a_size;
+  const char* b_end = b + b_size;
+  while (a < a_end && b < b_end) {
+    const uint64_t a_subidentifier = DecodeSubidentifier(&a, a_end);
+    const uint64_t b_subidentifier = DecodeSubidentifier(&b, b_end);
+    if (a_subidentifier != b_subidentifier) {
+      return a_subidentifier < b_subidentifier ? -1 : 1;
+    }
+  }
+  return int(a < a_end) - int(b < b_end);
+}
+
+void SNMPProxy::SNMPSequence::AppendNullVarbind(const char* name,
+                                                uint64_t name_size,
+                                                ArenaString* varbind_list) {
+  const char null_value[] = {char(kNullType), '\0'};
+  AppendVarbind(name, name_size, null_value, sizeof(null_value),
+                varbind_list);
+}
+
+void SNMPProxy::SNMPSequence::AppendVarbind(const char* name,
+                                            uint64_t name_size,
+                                            const char* value,
+                                            uint64_t value_size,
+                                            ArenaString* varbind_list) {
+  ArenaString varbind;
+  varbind += kObjectIdentifierType;
+  varbind += EncodeASN1Int(name_size);
+  varbind.append(name, name_size);
+  varbind.append(value, value_size);
+  *varbind_list += kSequenceType;
+  *varbind_list += EncodeASN1Int(varbind.size());
+  *varbind_list += varbind;
+}
+
+ArenaString SNMPProxy::SNMPSequence::BuildData(
+    int64_t error_status, int64_t error_index,
+    const ArenaString& varbind_list) {
+  ArenaString result = EncodeASN1Integer(error_status);
+  result += EncodeASN1Integer(error_index);
+  result += kSequenceType;
+  result += EncodeASN1Int(varbind_list.size());
+  result += varbind_list;
+  return result;
+}
+
+bool SNMPProxy::SNMPSequence::ContinueWalk(const ArenaString& request_data,
+                                           const Fields& request_fields,
+                                           const ArenaString& response_data,
+                                           ArenaString* result) {
+  const size_t num_varbinds = request_fields.varbinds.size();
+  Fields response_fields;
+  if (request_fields.error_status != 0 || num_varbinds == 0 ||
+      !ParseData(response_data, &response_fields) ||
+      response_fields.error_status != 0 ||
+      response_fields.varbinds.size() < num_varbinds) {
+    return false;
+  }
+  ArenaString varbind_list;
+  for (size_t i = response_fields.varbinds.size() - num_varbinds;
+       i < response_fields.varbinds.size(); ++i) {
+    const std::pair<size_t, size_t>& varbind = response_fields.varbinds[i];
+    const char* name;
+    uint64_t name_size;
+    uint8_t value_type;
+    if (!VarbindName(response_data, varbind, &name, &name_size,
+                     &value_type) ||
+        value_type == kEndOfMibViewType) {
+      return false;
+    }
+    AppendNullVarbind(name, name_size, &varbind_list);
+  }
+  result->assign(request_data, 0, request_fields.varbind_list_offset);
+  *result += kSequenceType;
+  *result += EncodeASN1Int(varbind_list.size());
+  *result += varbind_list;
+  return true;
+}
+
+bool SNMPProxy::SNMPSequence::ResponseAnswers(
+    uint8_t pdu_type, const ArenaString& request_data,
+    const ArenaString& response_data) {
+  Fields request_fields;
+  Fields response_fields;
+  if (!ParseData(request_data, &request_fields)) {
+    return true;
+  }
+  if (!ParseData(response_data, &response_fields)) {
+    return false;
+  }
+  const size_t num_varbinds = response_fields.varbinds.size();
+
+  // Errors like tooBig may come without variable bindings. GetBulk responses
+  // have as many as fit, and their first repetition follows the
+  // non-repeaters, in the order of the request's.
+  if (num_varbinds == 0 && response_fields.error_status != 0) {
+    return true;
+  }
+  if (pdu_type != kGetBulkRequestPDUType &&
+      num_varbinds != request_fields.varbinds.size()) {
+    return false;
+  }
+  for (size_t i = 0;
+       i < std::min(num_varbinds, request_fields.varbinds.size()); ++i) {
+    const char* request_name;
+    uint64_t request_name_size;
+    const char* response_name;
+    uint64_t response_name_size;
+    if (!VarbindName(request_data, request_fields.varbinds[i], &request_name,
+                     &request_name_size) ||
+        !VarbindName(response_data, response_fields.varbinds[i],
+                     &response_name, &response_name_size)) {
+      return false;
+    }
+    const int order = CompareOIDs(response_name, response_name_size,
+                                  request_name, request_name_size);
+    if ((pdu_type == kGetNextRequestPDUType ||
+         pdu_type == kGetBulkRequestPDUType) ? order < 0 : order != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+ArenaString SNMPProxy::SNMPSequence::SelectVarbinds(
+    const ArenaString& data, const Fields& fields,
+    const ArenaVector<size_t>& indices) {
+  ArenaString varbind_list;
+  for (size_t index : indices) {
+    varbind_list.append(data, fields.varbinds[index].first,
+                        fields.varbinds[index].second);
+  }
+  ArenaString result(data, 0, fields.varbind_list_offset);
+  result += kSequenceType;
+  result += EncodeASN1Int(varbind_list.size());
+  result += varbind_list;
+  return result;
+}
+
+uint8_t SNMPProxy::SNMPSequence::DecodeASN1Int(
+    const char* start, const char* end, uint64_t* result){
+  if (start >= end) {
+    *result = 0;
+    return 0;
+  }
+  if (!(*start & 0x80)) {
+    *result = uint8_t(*start);
+    return 1;
+  }
+  uint8_t size = (*start & ~(0x80));
+  if (size > sizeof(*result) || start + size >= end) {
+    *result = 0;
+    return 0;
+  }
+  *result = 0;
+  for (uint8_t i = 0; i < size; ++i) {
+    ++start;
+    *result = *result << 8;
+    *result += uint8_t(*start);
+  }
+  return size + 1;
+}
+
+bool SNMPProxy::SNMPSequence::DecodeASN1TypeAndLength(const char** start,
+                                                      const char* end,
+                                                      uint8_t* type,
+                                                      uint64_t* length) {
+  if (*start >= end) {
+    return false;
+  }
+  *type = **start;
+  ++*start;
+  const uint8_t length_size = DecodeASN1Int(*start, end, length);
+  if (length_size == 0) {
+    return false;
+  }
+  *start += length_size;
+  return *length <= uint64_t(end - *start);
+}
+
+bool SNMPProxy::SNMPSequence::DecodeASN1Integer(const char* start,
+                                                uint64_t length,
+                                                int64_t* result) {
+  if (length == 0 || length > sizeof(*result)) {
+    return false;
+  }
+  uint64_t value = (*start & 0x80) ? ~uint64_t(0) : 0;
+  for (uint64_t i = 0; i < length; ++i) {
+    value = (value << 8) | uint8_t(start[i]);
+  }
+  *result = int64_t(value);
+  return true;
+}
+
+ArenaString SNMPProxy::SNMPSequence::EncodeASN1Integer(int64_t input) {
+  ArenaString value;
+  do {
+    value.insert(value.begin(), char(input & 0xff));
+    input >>= 8;
+  } while (!(input == 0 && !(value[0] & 0x80)) &&
+           !(input == -1 && (value[0] & 0x80)));
+  ArenaString result;
+  result += kIntegerType;
+  result += EncodeASN1Int(value.size());
+  result += value;
+  return result;
+}
+
+ArenaString SNMPProxy::SNMPSequence::EncodeASN1Int(uint64_t input) {
+  ArenaString result;
+  if (input < 0x80) {
+    result = uint8_t(input);
+    return result;
+  }
+  for (uint8_t i = sizeof(input); i > 0; --i) {
+    const uint8_t& byte = *((uint8_t*)&input + i - 1);
+    if (result.empty() && byte > 0) {
+      result = (i | 0x80); 
+    }       
+    if (!result.empty()) {
+      result += byte;
+    }
+  }
+  return result;
+}
+
+SNMPProxy::CacheKey::CacheKey(const ArenaString& backend_address,
+                              const ArenaString& community,
+                              const ArenaString& community_index,
+                              uint8_t request_type,
+                              const ArenaString& request_data) :
+    backend_address_(backend_address), community_(community),
+    community_index_(community_index), request_type_(request_type),
+    request_data_(request_data),
+    hash_(HashFields(backend_address, community, community_index,
+                     request_type, request_data)) {}
+
+SNMPProxy::CacheKey::CacheKey(const CacheKey& other, Arena* arena) :
+    backend_address_(other.backend_address_, ArenaAllocator<char>(arena)),
+    community_(other.community_, ArenaAllocator<char>(arena)),
+    community_index_(other.community_index_, ArenaAllocator<char>(arena)),
+    request_type_(other.request_type_),
+    request_data_(other.request_data_, ArenaAllocator<char>(arena)),
+    hash_(other.hash_) {}
+
+bool SNMPProxy::CacheKey::operator==(const CacheKey& other) const {
+  return (hash_ == other.hash_ &&
+          backend_address_ == other.backend_address_ &&
+          community_ == other.community_ &&
+          community_index_ == other.community_index_ &&
+          request_type_ == other.request_type_ &&
+          request_data_ == other.request_data_);
+}
+
+const ArenaString& SNMPProxy::CacheKey::backend_address() const {
+  return backend_address_;
+}
+
+uint64_t SNMPProxy::CacheKey::hash() const {
+  return hash_;
+}
+
+void SNMPProxy::CacheKey::Serialize(std::string* output) const {
+  AppendHandoffString(backend_address_, output);
+  AppendHandoffString(community_, output);
+  AppendHandoffString(community_index_, output);
+  AppendHandoffInt(request_type_, output);
+  AppendHandoffString(request_data_, output);
+}
+
+bool SNMPProxy::CacheKey::Deserialize(const char** start, const char* end,
+                                      std::unique_ptr<CacheKey>* cache_key) {
+  ArenaString backend_address, community, community_index, request_data;
+  uint8_t request_type;
+  if (!ReadHandoffString(start, end, &backend_address) ||
+      !ReadHandoffString(start, end, &community) ||
+      !ReadHandoffString(start, end, &community_index) ||
+      !ReadHandoffInt(start, end, &request_type) ||
+      !ReadHandoffString(start, end, &request_data)) {
+    return false;
+  }
+  cache_key->reset(new CacheKey(backend_address, community, community_index,
+                                request_type, request_data));
+  return true;
+}
+
+uint64_t SNMPProxy::CacheKey::HashFields(const ArenaString& backend_address,
+                                         const ArenaString& community,
+                                         const ArenaString& community_index,
+                                         uint8_t request_type,
+                                         const ArenaString& request_data) {
+  ArenaString packed_key;
+  packed_key.reserve(3 * 2 + backend_address.size() + community.size() +
+                     community_index.size() + 1 + request_data.size());
+  for (const ArenaString* field :
+       {&backend_address, &community, &community_index}) {
+    // Fields come from datagrams, so their lengths fit in two bytes.
+    packed_key += char(field->size() & 0xff);
+    packed_key += char(field->size() >> 8);
+    packed_key += *field;
+  }
+  packed_key += char(request_type);
+  packed_key += request_data;
+  return HashBytes(packed_key.data(), packed_key.size());
+}
+
+size_t SNMPProxy::StringHash::operator()(const ArenaString& input) const {
+  return HashBytes(input.data(), input.size());
+}
+
+SNMPProxy::CacheValue::CacheValue() {}
+
+SNMPProxy::CacheValue::CacheValue(const ArenaString& response_data,
+                                  int64_t max_repetitions) :
+    response_data_(response_data, ArenaAllocator<char>(nullptr)),
+    max_repetitions_(max_repetitions) {}
+
+SNMPProxy::CacheValue::CacheValue(const CacheValue& other, Arena* arena) :
+    response_data_(other.response_data_, ArenaAllocator<char>(arena)),
+    max_repetitions_(other.max_repetitions_) {}
+
+int64_t SNMPProxy::CacheValue::max_repetitions() const {
+  return max_repetitions_;
+}
+
+const ArenaString& SNMPProxy::CacheValue::response_data() const {
+  return response_data_;
+}
+
+const uint32_t SNMPProxy::Cache::kNoSlot;
+const size_t SNMPProxy::Cache::kNumGenerations;
+
+SNMPProxy::Cache::Cache() :
+    index_hashes_(16), index_slots_(16, kNoSlot), size_(0),
+    generations_(new std::atomic<uint32_t>[kNumGenerations]) {
+  for (size_t i = 0; i < kNumGenerations; ++i) {
+    generations_[i] = 0;
+  }
+}
+
+uint32_t SNMPProxy::Cache::Find(const CacheKey& key) const {
+  const size_t mask = index_slots_.size() - 1;
+  for (size_t i = key.hash() & mask; index_slots_[i] != kNoSlot;
+       i = (i + 1) & mask) {
+    if (index_hashes_[i] == key.hash() &&
+        entries_[index_slots_[i]]->first == key) {
+      return index_slots_[i];
+    }
+  }
+  return kNoSlot;
+}
+
+void SNMPProxy::Cache::Find(const CacheKey* const* keys, size_t num_keys,
+                            uint32_t* slots) const {
+  const size_t mask = index_slots_.size() - 1;
+  for (size_t i = 0; i < num_keys; ++i) {
+    const size_t position = keys[i]->hash() & mask;
+    __builtin_prefetch(&index_hashes_[position]);
+    __builtin_prefetch(&index_slots_[position]);
+  }
+
+  // Take the first position with a matching hash as the likely slot, and
+  // prefetch what it takes to confirm and serve it.
+  for (size_t i = 0; i < num_keys; ++i) {
+    slots[i] = kNoSlot;
+    for (size_t j = keys[i]->hash() & mask; index_slots_[j] != kNoSlot;
+         j = (j + 1) & mask) {
+      if (index_hashes_[j] == keys[i]->hash()) {
+        slots[i] = index_slots_[j];
+        __builtin_prefetch(&entries_[slots[i]]);
+        __builtin_prefetch(&expiry_times_[slots[i]]);
+        break;
+      }
+    }
+  }
+  for (size_t i = 0; i < num_keys; ++i) {
+    if (slots[i] != kNoSlot) {
+      __builtin_prefetch(entries_[slots[i]].get());
+    }
+  }
+
+  // A hash collision is confirmed or ruled out the slow way.
+  for (size_t i = 0; i < num_keys; ++i) {
+    if (slots[i] != kNoSlot && !(entries_[slots[i]]->first == *keys[i])) {
+      slots[i] = Find(*keys[i]);
+    }
+  }
+}
+
+void SNMPProxy::Cache::Insert(const CacheKey& key, const CacheValue& value,
+                              int64_t time, int64_t expiry_time) {
+  ++generations_[key.hash() % kNumGenerations];
+  uint32_t slot = Find(key);
+  if (slot != kNoSlot) {
+    entries_[slot]->second = value;
+  } else {
+    if ((size_ + 1) * 2 > index_slots_.size()) {
+      GrowIndex();
+    }
+    if (free_slots_.empty()) {
+      slot = entries_.size();
+      entries_.emplace_back();
+      times_.push_back(0);
+      expiry_times_.push_back(0);
+      sizes_.push_back(0);
+    } else {
+      slot = free_slots_.back();
+      free_slots_.pop_back();
+    }
+    entries_[slot].reset(new Entry(CacheKey(key, nullptr), value));
+    const size_t mask = index_slots_.size() - 1;
+    size_t i = key.hash() & mask;
+    while (index_slots_[i] != kNoSlot) {
+      i = (i + 1) & mask;
+    }
+    index_hashes_[i] = key.hash();
+    index_slots_[i] = slot;
+    ++size_;
+  }
+  times_[slot] = time;
+  expiry_times_[slot] = expiry_time;
+  sizes_[slot] = value.response_data().size();
+}
+
+void SNMPProxy::Cache::Erase(uint32_t slot) {
+  const uint64_t hash = entries_[slot]->first.hash();
+  ++generations_[hash % kNumGenerations];
+  const size_t mask = index_slots_.size() - 1;
+  size_t i = hash & mask;
+  while (index_slots_[i] != slot) {
+    i = (i + 1) & mask;
+  }
+
+  // Shift back later keys of the probe run that would otherwise no longer be
+  // reachable from their home positions through the emptied one.
+  for (size_t j = (i + 1) & mask; index_slots_[j] != kNoSlot;
+       j = (j + 1) & mask) {
+    const size_t home = index_hashes_[j] & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      index_hashes_[i] = index_hashes_[j];
+      index_slots_[i] = index_slots_[j];
+      i = j;
+    }
+  }
+  index_slots_[i] = kNoSlot;
+
+  entries_[slot].reset();
+  times_[slot] = 0;
+  expiry_times_[slot] = std::numeric_limits<int64_t>::max();
+  sizes_[slot] = 0;
+  free_slots_.push_back(slot);
+  --size_;
+}
+
+size_t SNMPProxy::Cache::EraseExpiredBefore(int64_t time) {
+  size_t num_erased = 0;
+  for (uint32_t slot = 0; slot < expiry_times_.size(); ++slot) {
+    if (expiry_times_[slot] < time) {
+      Erase(slot);
+      ++num_erased;
+    }
+  }
+  return num_erased;
+}
+
+const SNMPProxy::Cache::Entry* SNMPProxy::Cache::entry(uint32_t slot) const {
+  return entries_[slot].get();
+}
+
+int64_t SNMPProxy::Cache::time(uint32_t slot) const {
+  return times_[slot];
+}
+
+int64_t SNMPProxy::Cache::expiry_time(uint32_t slot) const {
+  return expiry_times_[slot];
+}
+
+uint32_t SNMPProxy::Cache::num_slots() const {
+  return entries_.size();
+}
+
+size_t SNMPProxy::Cache::size() const {
+  return size_;
+}
+
+size_t SNMPProxy::Cache::index_size() const {
+  return index_slots_.size();
+}
+
+size_t SNMPProxy::Cache::response_bytes() const {
+  size_t response_bytes = 0;
+  for (uint32_t size : sizes_) {
+    response_bytes += size;
+  }
+  return response_bytes;
+}
+
+void SNMPProxy::Cache::ProbeLengths(std::vector<size_t>* histogram,
+                                    size_t* longest_probe) const {
+  const size_t mask = index_slots_.size() - 1;
+  histogram->clear();
+  *longest_probe = 0;
+  for (size_t i = 0; i < index_slots_.size(); ++i) {
+    if (index_slots_[i] == kNoSlot) {
+      continue;
+    }
+    const size_t probe = ((i - index_hashes_[i]) & mask) + 1;
+    *longest_probe = std::max(*longest_probe, probe);
+    size_t bucket = 0;
+    while ((size_t(1) << bucket) < probe) {
+      ++bucket;
+    }
+    if (bucket >= histogram->size()) {
+      histogram->resize(bucket + 1);
+    }
+    ++(*histogram)[bucket];
+  }
+}
+
+const std::atomic<uint32_t>* SNMPProxy::Cache::generation(
+    uint64_t hash) const {
+  return &generations_[hash % kNumGenerations];
+}
+
+void SNMPProxy::Cache::GrowIndex() {
+  std::vector<uint64_t> index_hashes(index_hashes_.size() * 2);
+  std::vector<uint32_t> index_slots(index_slots_.size() * 2, kNoSlot);
+  const size_t mask = index_slots.size() - 1;
+  for (size_t i = 0; i < index_slots_.size(); ++i) {
+    if (index_slots_[i] == kNoSlot) {
+      continue;
+    }
+    size_t j = index_hashes_[i] & mask;
+    while (index_slots[j] != kNoSlot) {
+      j = (j + 1) & mask;
+    }
+    index_hashes[j] = index_hashes_[i];
+    index_slots[j] = index_slots_[i];
+  }
+  index_hashes_.swap(index_hashes);
+  index_slots_.swap(index_slots);
+}
+
+SNMPProxy::NearCache::NearCache(size_t size) :
+    slots_(new Slot[size]), size_(size) {
+  for (size_t i = 0; i < size_; ++i) {
+    slots_[i].arena.reset(new Arena(kNearCacheArenaSize));
+  }
+}
+
+const SNMPProxy::CacheValue* SNMPProxy::NearCache::Find(
+    const CacheKey& key, int64_t time) const {
+  const Slot& slot = slots_[key.hash() % size_];
+  if (slot.key == nullptr || time > slot.expiry_time ||
+      slot.generation->load() != slot.copied_generation ||
+      !(*slot.key == key)) {
+    return nullptr;
+  }
+  return slot.value;
+}
+
+void SNMPProxy::NearCache::Insert(const CacheKey& key,
+                                  const CacheValue& value, const Cache& cache,
+                                  int64_t expiry_time) {
+  Slot& slot = slots_[key.hash() % size_];
+  slot.Clear();
+  Arena* arena = slot.arena.get();
+  slot.key = new (arena->Allocate(sizeof(CacheKey))) CacheKey(key, arena);
+  slot.value = new (arena->Allocate(sizeof(CacheValue))) CacheValue(value,
+                                                                    arena);
+  slot.generation = cache.generation(key.hash());
+  slot.copied_generation = slot.generation->load();
+  slot.expiry_time = expiry_time;
+}
+
+SNMPProxy::NearCache::Slot::Slot() :
+    key(nullptr), value(nullptr), generation(nullptr), copied_generation(0),
+    expiry_time(0) {}
+
+SNMPProxy::NearCache::Slot::~Slot() {
+  Clear();
+}
+
+void SNMPProxy::NearCache::Slot::Clear() {
+  if (key == nullptr) {
+    return;
+  }
+  key->~CacheKey();
+  value->~CacheValue();
+  key = nullptr;
+  value = nullptr;
+  arena->Reset();
+}
+
+SNMPProxy::BackendClient::BackendClient() :
+    socket(io_service), timer(io_service), num_queries(0) {
+  socket.open(udp::v4());
+}
+
+size_t SNMPProxy::QueryBackend(BackendClient* backend_client,
+                               const udp::endpoint& backend_endpoint,
+                               const SNMPSequence& snmp_request,
+                               boost::array<char, 65536>* response) {
+  // The socket outlives queries that timed out, so responses to them may
+  // still be waiting on it, with the same request ID if the client's were
+  // passed through. Each query gets an ID of its own instead, kept between
+  // 2^24 and 2^31 so that agents encode it in four bytes like ours.
+  const uint32_t request_id =
+      htonl(0x01000000 + backend_client->num_queries++ % 0x7f000000);
+  SNMPSequence backend_request(snmp_request);
+  backend_request.set_request_id(request_id);
+
+  udp::socket& socket = backend_client->socket;
+  boost::system::error_code error;
+  socket.send_to(boost::asio::buffer(backend_request.Serialize()),
+                 backend_endpoint, 0, error);
+  if (error) {
+    return 0;
+  }
+
+  bool timed_out = false;
+  backend_client->timer.expires_from_now(
+      std::chrono::milliseconds(backend_timeout_ms_));
+  backend_client->timer.async_wait(MakeMemoryHandler(
+      &backend_client->handler_memory,
+      [&timed_out](const boost::system::error_code& error) {
+        timed_out = !error;
+      }));
+
+  // Take the first datagram from the backend that answers this query, or
+  // that we can't make sense of, and give it the client's request ID back.
+  size_t response_size = 0;
+  bool receiving = false;
+  udp::endpoint sender_endpoint;
+  size_t received_size = 0;
+  backend_client->io_service.reset();
+  while (!timed_out && response_size == 0) {
+    if (!receiving) {
+      receiving = true;
+      received_size = 0;
+      socket.async_receive_from(
+          boost::asio::buffer(*response), sender_endpoint,
+          MakeMemoryHandler(
+              &backend_client->handler_memory,
+              [&receiving, &received_size](
+                  const boost::system::error_code& error, size_t size) {
+                receiving = false;
+                received_size = error ? 0 : size;
+              }));
+    }
+    if (backend_client->io_service.run_one() == 0) {
+      break;
+    }
+    if (!receiving && received_size > 0 &&
+        sender_endpoint == backend_endpoint) {
+      SNMPSequence snmp_response(response->data(),
+                                 response->data() + received_size);
+      if (!snmp_response.initialized()) {
+        response_size = received_size;
+      } else if (snmp_response.request_id() == request_id &&
+                 SNMPSequence::ResponseAnswers(snmp_request.pdu_type(),
+                                               snmp_request.data(),
+                                               snmp_response.data())) {
+        // The request ID immediately precedes the rest of the data.
+        const uint32_t client_request_id = snmp_request.request_id();
+        memcpy(response->data() + received_size -
+                   snmp_response.data().size() - sizeof(client_request_id),
+               &client_request_id, sizeof(client_request_id));
+        response_size = received_size;
+      }
+    }
+  }
+
+  // Let the outstanding operations finish before their handlers' state goes
+  // away.
+  backend_client->timer.cancel();
+  socket.cancel();
+  backend_client->io_service.run();
+  return response_size;
+}
+
+// Get requests carry an error status and index, which are zero.
+struct SNMPProxy::GetPDU {
+  // Whether the request fields were parsed.
+  static const bool kParsed = true;
+
+  // Whether clients walk tables with requests of the type.
+  static const bool kWalk = false;
+
+  // Variables after each one named that a request asks for, or 0 if that
+  // isn't all it asks for.
+  static int64_t Repetitions(const SNMPSequence::Fields&) {
+    return 1;
+  }
+
+  static ArenaVector<size_t> CanonicalOrder(
+      const ArenaString& request_data,
+      const SNMPSequence::Fields& request_fields) {
+    return CanonicalVarbindOrder(request_data, request_fields, 0);
+  }
+
+  // Removes what doesn't tell cache entries apart from request data.
+  static void StripKeyData(const SNMPSequence::Fields&, ArenaString*) {}
+
+  static int64_t MaxRepetitions(const SNMPSequence::Fields&) {
+    return 0;
+  }
+
+  // Whether a fresh cache entry answers a request.
+  static bool Answers(const CacheValue&, const SNMPSequence::Fields&) {
+    return true;
+  }
+
+  // Turns response data to the canonical request, from the cache or from the
+  // backend, into what the client asked for.
+  static ArenaString ServeCached(const ArenaString& response_data,
+                                 const SNMPSequence::Fields& request_fields,
+                                 const ArenaVector<size_t>& varbind_order) {
+    return RestoreVarbindOrder(response_data, request_fields, false,
+                               varbind_order);
+  }
+  static ArenaString ServeFetched(const ArenaString& response_data,
+                                  const SNMPSequence::Fields& request_fields,
+                                  const ArenaVector<size_t>& varbind_order) {
+    return ServeCached(response_data, request_fields, varbind_order);
+  }
+};
+
+// GetNext requests are laid out and cached like Get requests.
+struct SNMPProxy::GetNextPDU : GetPDU {
+  static const bool kWalk = true;
+};
+
+// GetBulk requests carry non-repeaters and max-repetitions where Get requests
+// carry the error status and index.
+struct SNMPProxy::GetBulkPDU {
+  static const bool kParsed = true;
+  static const bool kWalk = true;
+
+  static ArenaVector<size_t> CanonicalOrder(
+      const ArenaString& request_data,
+      const SNMPSequence::Fields& request_fields) {
+    return CanonicalVarbindOrder(request_data, request_fields,
+                                 NonRepeaters(request_fields));
+  }
+
+  // Requests that differ only in max-repetitions share a cache entry.
+  static void StripKeyData(const SNMPSequence::Fields& request_fields,
+                           ArenaString* request_data) {
+    request_data->erase(request_fields.error_index_offset,
+                        request_fields.varbind_list_offset -
+                            request_fields.error_index_offset);
+  }
+
+  static int64_t MaxRepetitions(const SNMPSequence::Fields& request_fields) {
+    return request_fields.error_index;
+  }
+
+  static int64_t Repetitions(const SNMPSequence::Fields& request_fields) {
+    return NonRepeaters(request_fields) == 0 ? request_fields.error_index : 0;
+  }
+
+  // A cached response with too few repetitions is refetched, and the new
+  // response replaces it.
+  static bool Answers(const CacheValue& cache_value,
+                      const SNMPSequence::Fields& request_fields) {
+    return cache_value.max_repetitions() >= request_fields.error_index;
+  }
+
+  static ArenaString ServeCached(const ArenaString& response_data,
+                                 const SNMPSequence::Fields& request_fields,
+                                 const ArenaVector<size_t>& varbind_order) {
+    return RestoreVarbindOrder(
+        TruncateBulkResponse(response_data, request_fields), request_fields,
+        true, varbind_order);
+  }
+  static ArenaString ServeFetched(const ArenaString& response_data,
+                                  const SNMPSequence::Fields& request_fields,
+                                  const ArenaVector<size_t>& varbind_order) {
+    return RestoreVarbindOrder(response_data, request_fields, true,
+                               varbind_order);
+  }
+};
+
+// Requests of any type whose variable bindings didn't parse. Their data is
+// the cache key as it is, and responses are served as they are.
+struct SNMPProxy::OpaquePDU {
+  static const bool kParsed = false;
+  static const bool kWalk = false;
+
+  static ArenaVector<size_t> CanonicalOrder(const ArenaString&,
+                                            const SNMPSequence::Fields&) {
+    return ArenaVector<size_t>();
+  }
+
+  static void StripKeyData(const SNMPSequence::Fields&, ArenaString*) {}
+
+  static int64_t MaxRepetitions(const SNMPSequence::Fields&) {
+    return 0;
+  }
+
+  static bool Answers(const CacheValue&, const SNMPSequence::Fields&) {
+    return true;
+  }
+
+  static ArenaString ServeCached(const ArenaString& response_data,
+                                 const SNMPSequence::Fields&,
+                                 const ArenaVector<size_t>&) {
+    return ArenaString(response_data.data(), response_data.size());
+  }
+  static ArenaString ServeFetched(const ArenaString& response_data,
+                                  const SNMPSequence::Fields&,
+                                  const ArenaVector<size_t>&) {
+    return ArenaString(response_data.data(), response_data.size());
+  }
+};
+
+template <typename PDU>
+ArenaString SNMPProxy::ServeCacheValue(
+    const CacheValue& cache_value, const ArenaString& backend_host,
+    const SNMPSequence& snmp_request,
+    const SNMPSequence::Fields& request_fields,
+    const ArenaVector<size_t>& varbind_order) {
+  SNMPSequence snmp_response(snmp_request);
+  snmp_response.set_community(backend_host);
+  snmp_response.set_pdu_type(kGetResponsePDUType);
+  snmp_response.set_data(PDU::ServeCached(cache_value.response_data(),
+                                          request_fields, varbind_order));
+  return snmp_response.Serialize();
+}
+
+template <typename PDU>
+SNMPProxy::CacheKey SNMPProxy::KeyRequest(
+    const SNMPSequence& snmp_request,
+    const SNMPSequence::Fields& request_fields,
+    const ArenaString& backend_address, SNMPSequence* canonical_request,
+    ArenaVector<size_t>* varbind_order) {
+  // Requests for the same variables in a different order share a cache entry.
+  // Backends are queried in canonical order, and responses are put back into
+  // the client's order before they are served.
+  *varbind_order = PDU::CanonicalOrder(snmp_request.data(), request_fields);
+  if (!varbind_order->empty()) {
+    canonical_request->set_data(SNMPSequence::SelectVarbinds(
+        snmp_request.data(), request_fields, *varbind_order));
+  }
+  ArenaString request_data = canonical_request->data();
+  PDU::StripKeyData(request_fields, &request_data);
+
+  return CacheKey(backend_address, snmp_request.community(),
+                  snmp_request.community_index(), snmp_request.pdu_type(),
+                  request_data);
+}
+
+template <typename PDU>
+ArenaString SNMPProxy::GetResponse(const ArenaString& backend_host,
+                                   uint32_t client_address,
+                                   const SNMPSequence& snmp_request,
+                                   const SNMPSequence::Fields& request_fields,
+                                   BackendClient* backend_client,
+                                   bool* cache_hit, bool prefetch) {
+  // Backends resolved before are found without taking any lock, ahead of
+  // the near cache. A request that has to resolve its backend allocates, so
+  // it is not counted as a hit.
+  udp::endpoint remote_endpoint;
+  ArenaString backend_address;
+  const bool resolved =
+      FindBackend(backend_host, &remote_endpoint, &backend_address);
+  if (!resolved &&
+      !ResolveBackend(backend_host, &remote_endpoint, &backend_address)) {
+    std::cerr << "Could not resolve " << backend_host << "." << std::endl;
+    return ErrorResponse(backend_host, snmp_request);
+  }
+
+  const int64_t max_repetitions = PDU::MaxRepetitions(request_fields);
+  SNMPSequence canonical_request(snmp_request);
+  ArenaVector<size_t> varbind_order;
+  const CacheKey key = KeyRequest<PDU>(snmp_request, request_fields,
+                                       backend_address, &canonical_request,
+                                       &varbind_order);
+  Node* partition = CachePartition(key.backend_address());
+
+  // Prefetches look past the near cache, since what they find in the shared
+  // one decides whether to fetch.
+  NearCache* near_cache = prefetch ? nullptr : ThreadNearCache();
+  if (near_cache != nullptr) {
+    const CacheValue* cache_value = near_cache->Find(key, NowMs());
+    if (cache_value != nullptr && PDU::Answers(*cache_value, request_fields)) {
+      *cache_hit = resolved;
+      return ServeCacheValue<PDU>(*cache_value, backend_host, snmp_request,
+                                  request_fields, varbind_order);
+    }
+  }
+
+  // Prefetched responses are cached regardless of admission, since the
+  // client is expected to ask for them. Keys that had a cache entry have
+  // already been admitted.
+  bool admitted = prefetch || (PDU::kParsed &&
+                               AlwaysCache(snmp_request.data(),
+                                           request_fields));
+  PrefetchedKey prefetched_key(partition, key.hash());
+  // The stale response being refreshed, for learned TTLs to compare with.
+  ArenaString previous_data;
+  int64_t previous_time = -1;
+  {
+    std::unique_lock<std::mutex> lock(partition->cache_mutex);
+    partition->prefetched_cv.wait(lock, [partition, &key] {
+      return partition->keys_prefetching.empty() ||
+             partition->keys_prefetching.count(key.hash()) == 0;
+    });
+    const uint32_t cache_slot = partition->cache.Find(key);
+    if (cache_slot != Cache::kNoSlot) {
+      const Cache::Entry* cache_entry = partition->cache.entry(cache_slot);
+      admitted = true;
+      // Stale cache entry. Evict it and fall through to the backend.
+      const int64_t current_time = NowMs();
+      const int64_t expiry_time = partition->cache.expiry_time(cache_slot);
+      if (current_time > expiry_time) {
+        if (min_cache_ttl_ms_ != max_cache_ttl_ms_) {
+          previous_data = cache_entry->second.response_data();
+          previous_time = partition->cache.time(cache_slot);
+        }
+        partition->cache.Erase(cache_slot);
+      } else if (PDU::Answers(cache_entry->second, request_fields)) {
+        // Fresh cache entry. Serve it, and keep a copy near.
+        if (near_cache != nullptr) {
+          near_cache->Insert(key, cache_entry->second, partition->cache,
+                             std::min(expiry_time,
+                                      current_time + kNearCacheTTLMs));
+        }
+        *cache_hit = resolved;
+        return ServeCacheValue<PDU>(cache_entry->second, backend_host,
+                                    snmp_request, request_fields,
+                                    varbind_order);
+      }
+      // Otherwise, fall through to the backend, whose response will replace
+      // the entry.
+    }
+    if (prefetch) {
+      prefetched_key.Mark();
+    }
+  }
+
+  ClientMiss client_miss(this, client_address);
+  if (!client_miss.admitted()) {
+    return reject_over_limit_ ? ErrorResponse(backend_host, snmp_request) :
+                                ArenaString();
+  }
+  boost::array<char, 65536> response;
+  size_t response_size = 0;
+  for (unsigned int num_retries = 0;
+       num_retries <= num_backend_retries_ && response_size == 0;
+       ++num_retries) {
+    response_size = QueryBackend(backend_client, remote_endpoint,
+                                 canonical_request, &response);
+  }
+
+  // We didn't get a response. Cache and serve an unavailable error.
+  if (response_size == 0) {
     std::cerr << "Timeout while querying " << backend_host << "." << std::endl;
-    SNMPSequence snmp_response(snmp_request);
+    SNMPSequence snmp_response(canonical_request);
     snmp_response.set_community(backend_host);
     snmp_response.set_pdu_type(kGetResponsePDUType);
     snmp_response.set_error(kResourceUnavailableError);
-    std::lock_guard<std::mutex> lock(mutex_);
-    cache_[key] = CacheValue(snmp_response.data());
+    std::lock_guard<std::mutex> lock(partition->cache_mutex);
+    if (admitted || AdmitToCache(partition, key)) {
+      const int64_t current_time = NowMs();
+      partition->cache.Insert(
+          key, CacheValue(snmp_response.data(), max_repetitions),
+          current_time, current_time + cache_ttl_ms_);
+    }
     snmp_response.set_community(backend_host);
+    snmp_response.set_data(PDU::ServeFetched(
+        snmp_response.data(), request_fields, varbind_order));
     return snmp_response.Serialize();
   } else {
     // We got a response we could parse. Cache it and serve it.
     SNMPSequence snmp_response(response.data(),
                                response.data() + response_size);
     if (snmp_response.initialized()) {
-      std::lock_guard<std::mutex> lock(mutex_);
-      cache_[key] = CacheValue(snmp_response.data());
+      std::lock_guard<std::mutex> lock(partition->cache_mutex);
+      if (admitted || AdmitToCache(partition, key)) {
+        const int64_t current_time = NowMs();
+        partition->cache.Insert(
+            key, CacheValue(snmp_response.data(), max_repetitions),
+            current_time,
+            current_time + LearnCacheTTL(
+                partition, key.backend_address(), snmp_response.data(),
+                previous_time >= 0 ? &previous_data : nullptr,
+                previous_time));
+      }
       snmp_response.set_community(backend_host);
+      snmp_response.set_data(PDU::ServeFetched(
+          snmp_response.data(), request_fields, varbind_order));
       return snmp_response.Serialize();
     }
   }
-  // We got a response we couldn't parse. Serve it.
-  return std::string(response.data(), response_size);
+  // We got a response we couldn't parse. Serve it.
+  return ArenaString(response.data(), response_size);
+}
+
+ArenaString SNMPProxy::ErrorResponse(const ArenaString& backend_host,
+                                     const SNMPSequence& snmp_request) {
+  SNMPSequence snmp_response(snmp_request);
+  snmp_response.set_community(backend_host);
+  snmp_response.set_pdu_type(kGetResponsePDUType);
+  snmp_response.set_error(kResourceUnavailableError);
+  return snmp_response.Serialize();
+}
+
+bool SNMPProxy::AdmitToCache(Node* partition, const CacheKey& key) {
+  if (admission_window_ms_ == 0) {
+    return true;
+  }
+  const int64_t current_time = NowMs();
+  if (current_time >= partition->doorkeeper_reset_time + admission_window_ms_) {
+    partition->doorkeeper.Clear();
+    partition->doorkeeper_reset_time = current_time;
+  }
+  return partition->doorkeeper.TestAndSet(key.hash());
+}
+
+int64_t SNMPProxy::LearnCacheTTL(Node* partition,
+                                 const ArenaString& backend_address,
+                                 const ArenaString& response_data,
+                                 const ArenaString* previous_data,
+                                 int64_t previous_time) {
+  const int64_t default_ttl =
+      std::min(std::max(cache_ttl_ms_, min_cache_ttl_ms_), max_cache_ttl_ms_);
+  SNMPSequence::Fields fields;
+  if (min_cache_ttl_ms_ == max_cache_ttl_ms_ ||
+      !SNMPSequence::ParseData(response_data, &fields) ||
+      fields.error_status != 0 || fields.varbinds.empty()) {
+    return default_ttl;
+  }
+  SNMPSequence::Fields previous_fields;
+  if (previous_data == nullptr ||
+      !SNMPSequence::ParseData(*previous_data, &previous_fields) ||
+      previous_fields.error_status != 0) {
+    previous_fields.varbinds.clear();
+  }
+  const int64_t current_time = NowMs();
+  int64_t ttl = max_cache_ttl_ms_;
+  ArenaString column_key;
+  for (size_t i = 0; i < fields.varbinds.size(); ++i) {
+    const std::pair<size_t, size_t>& varbind = fields.varbinds[i];
+    const char* name;
+    uint64_t name_size;
+    if (!SNMPSequence::VarbindName(response_data, varbind, &name,
+                                   &name_size) ||
+        name_size == 0) {
+      return default_ttl;
+    }
+
+    // The column is the name up to its last subidentifier, the only byte of
+    // which without the high bit set is the last.
+    size_t column_size = name_size - 1;
+    while (column_size > 0 && (name[column_size - 1] & 0x80) != 0) {
+      --column_size;
+    }
+    column_key.clear();
+    column_key += char(backend_address.size() & 0xff);
+    column_key += char(backend_address.size() >> 8);
+    column_key += backend_address;
+    column_key.append(name, column_size);
+    const uint64_t column_hash = HashBytes(column_key.data(),
+                                           column_key.size());
+
+    // A variable of the same name in the same place in the refreshed response
+    // tells whether its value changed since then.
+    if (i < previous_fields.varbinds.size()) {
+      const std::pair<size_t, size_t>& previous_varbind =
+          previous_fields.varbinds[i];
+      const char* previous_name;
+      uint64_t previous_name_size;
+      if (SNMPSequence::VarbindName(*previous_data, previous_varbind,
+                                    &previous_name, &previous_name_size) &&
+          previous_name_size == name_size &&
+          memcmp(previous_name, name, name_size) == 0) {
+        const bool changed =
+            previous_varbind.second != varbind.second ||
+            memcmp(previous_data->data() + previous_varbind.first,
+                   response_data.data() + varbind.first, varbind.second) != 0;
+        ColumnVolatility& volatility =
+            partition->column_volatility[column_hash];
+        volatility.num_changes =
+            volatility.num_changes * (1 - kVolatilityDecay) + (changed ? 1 : 0);
+        volatility.observed_ms =
+            volatility.observed_ms * (1 - kVolatilityDecay) +
+            (current_time - previous_time);
+        volatility.last_time = current_time;
+      }
+    }
+
+    // Columns not yet seen refreshed get the default TTL, and those that were
+    // a fraction of the mean time between their changes.
+    const auto column = partition->column_volatility.find(column_hash);
+    int64_t column_ttl = default_ttl;
+    if (column != partition->column_volatility.end()) {
+      const ColumnVolatility& volatility = column->second;
+      column_ttl = volatility.num_changes <= 0
+                       ? max_cache_ttl_ms_
+                       : int64_t(std::min<double>(
+                             max_cache_ttl_ms_,
+                             kTTLPerChangeInterval * volatility.observed_ms /
+                                 volatility.num_changes));
+    }
+    ttl = std::min(ttl, column_ttl);
+  }
+  return std::max(ttl, min_cache_ttl_ms_);
+}
+
+bool SNMPProxy::AlwaysCache(const ArenaString& request_data,
+                            const SNMPSequence::Fields& request_fields) const {
+  if (always_cache_prefixes_.empty() || request_fields.varbinds.empty()) {
+    return false;
+  }
+  for (const std::pair<size_t, size_t>& varbind : request_fields.varbinds) {
+    const char* name;
+    uint64_t name_size;
+    if (!SNMPSequence::VarbindName(request_data, varbind, &name, &name_size)) {
+      return false;
+    }
+    bool matched = false;
+    for (const std::string& prefix : always_cache_prefixes_) {
+      if (name_size >= prefix.size() &&
+          memcmp(name, prefix.data(), prefix.size()) == 0) {
+        matched = true;
+        break;
+      }
+    }
+    if (!matched) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SNMPProxy::AdmitRequest(uint32_t client_address) {
+  if (client_requests_per_sec_ == 0) {
+    return true;
+  }
+
+  // A token bucket kept as the time it would be full again: each request
+  // pushes it one token's worth later, and none may push it further than a
+  // full burst ahead of now. Being a single time, it is updated with a CAS.
+  const int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  const int64_t token_ns = int64_t(1e9 / client_requests_per_sec_);
+  std::atomic<int64_t>* full_time =
+      &client_full_times_[ClientSlot(client_address)];
+  int64_t current_full_time = full_time->load();
+  int64_t next_full_time;
+  do {
+    next_full_time = std::max(current_full_time, now) + token_ns;
+    if (next_full_time - now > int64_t(client_burst_) * token_ns) {
+      ++num_rejected_requests_;
+      return false;
+    }
+  } while (!full_time->compare_exchange_weak(current_full_time,
+                                             next_full_time));
+  return true;
+}
+
+SNMPProxy::ClientMiss::ClientMiss(SNMPProxy* snmp_proxy,
+                                  uint32_t client_address) :
+    misses_(nullptr), admitted_(true) {
+  if (snmp_proxy->max_client_misses_ == 0) {
+    return;
+  }
+  std::atomic<unsigned int>* misses =
+      &snmp_proxy->client_misses_[ClientSlot(client_address)];
+  if (misses->fetch_add(1) >= snmp_proxy->max_client_misses_) {
+    --*misses;
+    ++snmp_proxy->num_rejected_requests_;
+    admitted_ = false;
+    return;
+  }
+  misses_ = misses;
+}
+
+SNMPProxy::ClientMiss::~ClientMiss() {
+  if (misses_ != nullptr) {
+    --*misses_;
+  }
+}
+
+bool SNMPProxy::ClientMiss::admitted() const {
+  return admitted_;
+}
+
+SNMPProxy::BackendWalk::BackendWalk(SNMPProxy* snmp_proxy,
+                                    const std::string& backend_host) :
+    snmp_proxy_(snmp_proxy), backend_host_(backend_host) {
+  std::unique_lock<std::mutex> lock(snmp_proxy_->backend_walks_mutex_);
+  snmp_proxy_->backend_walks_cv_.wait(lock, [this] {
+    return snmp_proxy_->backend_walks_[backend_host_] <
+           snmp_proxy_->max_walks_per_backend_;
+  });
+  ++snmp_proxy_->backend_walks_[backend_host_];
+}
+
+SNMPProxy::BackendWalk::~BackendWalk() {
+  {
+    std::lock_guard<std::mutex> lock(snmp_proxy_->backend_walks_mutex_);
+    auto backend = snmp_proxy_->backend_walks_.find(backend_host_);
+    if (--backend->second == 0) {
+      snmp_proxy_->backend_walks_.erase(backend);
+    }
+  }
+  snmp_proxy_->backend_walks_cv_.notify_all();
+}
+
+bool SNMPProxy::FindBackend(const ArenaString& backend_host,
+                            udp::endpoint* endpoint,
+                            ArenaString* backend_address) {
+  // The lock is taken only to pick up a newly published map.
+  static thread_local std::shared_ptr<const BackendEndpoints>
+      backend_endpoints;
+  static thread_local uint64_t backend_endpoints_version;
+  if (!backend_endpoints ||
+      backend_endpoints_version != backend_endpoints_version_.load()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    backend_endpoints = backend_endpoints_;
+    backend_endpoints_version = backend_endpoints_version_.load();
+  }
+  auto backend = backend_endpoints->find(backend_host);
+  if (backend == backend_endpoints->end()) {
+    return false;
+  }
+  *endpoint = backend->second.endpoint;
+  backend_address->assign(backend->second.address.data(),
+                          backend->second.address.size());
+  return true;
+}
+
+bool SNMPProxy::ResolveBackend(const ArenaString& backend_host,
+                               udp::endpoint* endpoint,
+                               ArenaString* backend_address) {
+  if (FindBackend(backend_host, endpoint, backend_address)) {
+    return true;
+  }
+  ResolvedBackend resolved_backend;
+  if (!QueryResolver(backend_host, &resolved_backend)) {
+    return false;
+  }
+  *endpoint = resolved_backend.endpoint;
+  backend_address->assign(resolved_backend.address.data(),
+                          resolved_backend.address.size());
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::shared_ptr<BackendEndpoints> backend_endpoints(
+      new BackendEndpoints(*backend_endpoints_));
+  backend_endpoints->emplace(
+      ArenaString(backend_host, ArenaAllocator<char>(nullptr)),
+      resolved_backend);
+  backend_endpoints_ = backend_endpoints;
+  ++backend_endpoints_version_;
+  return true;
+}
+
+bool SNMPProxy::QueryResolver(const ArenaString& backend_host,
+                              ResolvedBackend* resolved_backend) {
+  udp::resolver resolver(io_service_);
+  udp::resolver::query query(
+      udp::v4(), std::string(backend_host.data(), backend_host.size()), "snmp");
+  boost::system::error_code error;
+  udp::resolver::iterator result = resolver.resolve(query, error);
+  if (error || result == udp::resolver::iterator()) {
+    return false;
+  }
+  resolved_backend->endpoint = *result;
+  const std::string address =
+      resolved_backend->endpoint.address().to_string();
+  resolved_backend->address = ArenaString(address.data(), address.size(),
+                                          ArenaAllocator<char>(nullptr));
+  return true;
+}
+
+void SNMPProxy::RefreshBackends() {
+  std::shared_ptr<const BackendEndpoints> backend_endpoints;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    backend_endpoints = backend_endpoints_;
+  }
+  if (backend_endpoints->empty()) {
+    return;
+  }
+
+  // Resolving may take a while, so it is done without the lock, and what
+  // was resolved in the meantime is kept. Nothing is published unless an
+  // address has changed.
+  std::vector<std::pair<ArenaString, ResolvedBackend>> resolved_backends;
+  std::vector<ArenaString> unresolved_backends;
+  for (const auto& backend : *backend_endpoints) {
+    ResolvedBackend resolved_backend;
+    if (QueryResolver(backend.first, &resolved_backend)) {
+      if (resolved_backend.endpoint != backend.second.endpoint) {
+        resolved_backends.emplace_back(backend.first, resolved_backend);
+      }
+    } else {
+      std::cerr << "Could not resolve " << backend.first << " again."
+                << std::endl;
+      unresolved_backends.push_back(backend.first);
+    }
+  }
+  if (resolved_backends.empty() && unresolved_backends.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::shared_ptr<BackendEndpoints> refreshed_backend_endpoints(
+      new BackendEndpoints(*backend_endpoints_));
+  for (const auto& resolved_backend : resolved_backends) {
+    (*refreshed_backend_endpoints)[resolved_backend.first] =
+        resolved_backend.second;
+  }
+  for (const ArenaString& unresolved_backend : unresolved_backends) {
+    refreshed_backend_endpoints->erase(unresolved_backend);
+  }
+  backend_endpoints_ = refreshed_backend_endpoints;
+  ++backend_endpoints_version_;
+}
+
+size_t SNMPProxy::NonRepeaters(const SNMPSequence::Fields& request_fields) {
+  return std::min<uint64_t>(std::max<int64_t>(request_fields.error_status, 0),
+                            request_fields.varbinds.size());
+}
+
+ArenaVector<size_t> SNMPProxy::CanonicalVarbindOrder(
+    const ArenaString& request_data, const SNMPSequence::Fields& request_fields,
+    size_t non_repeaters) {
+  ArenaVector<size_t> order(request_fields.varbinds.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  // Ties are broken by position, which keeps the sort stable without the
+  // temporary buffer std::stable_sort allocates.
+  auto less = [&](size_t a, size_t b) {
+    const std::pair<size_t, size_t>& varbind_a = request_fields.varbinds[a];
+    const std::pair<size_t, size_t>& varbind_b = request_fields.varbinds[b];
+    const int comparison = request_data.compare(
+        varbind_a.first, varbind_a.second, request_data, varbind_b.first,
+        varbind_b.second);
+    return comparison < 0 || (comparison == 0 && a < b);
+  };
+
+  // GetBulk non-repeaters and repeaters are sorted separately, since their
+  // positions determine how they are treated.
+  std::sort(order.begin(), order.begin() + non_repeaters, less);
+  std::sort(order.begin() + non_repeaters, order.end(), less);
+  return order;
+}
+
+ArenaString SNMPProxy::RestoreVarbindOrder(
+    const ArenaString& response_data, const SNMPSequence::Fields& request_fields,
+    bool bulk_request, const ArenaVector<size_t>& varbind_order) {
+  bool canonical = true;
+  for (size_t i = 0; i < varbind_order.size() && canonical; ++i) {
+    canonical = (varbind_order[i] == i);
+  }
+  SNMPSequence::Fields response_fields;
+  if (canonical || !SNMPSequence::ParseData(response_data, &response_fields)) {
+    return ArenaString(response_data.data(), response_data.size());
+  }
+
+  // Client position of each variable binding in canonical order, and the
+  // reverse.
+  ArenaVector<size_t> canonical_positions(varbind_order.size());
+  for (size_t i = 0; i < varbind_order.size(); ++i) {
+    canonical_positions[varbind_order[i]] = i;
+  }
+
+  // GetBulk responses hold the non-repeaters followed by rows of repeaters.
+  // Each is reordered separately, and a partial last row is dropped.
+  const size_t num_varbinds = varbind_order.size();
+  const size_t non_repeaters =
+      bulk_request ? NonRepeaters(request_fields) : num_varbinds;
+  const size_t repeaters = num_varbinds - non_repeaters;
+  const size_t num_response_varbinds = response_fields.varbinds.size();
+  if (num_response_varbinds < non_repeaters ||
+      (!bulk_request && num_response_varbinds != num_varbinds)) {
+    return ArenaString(response_data.data(), response_data.size());
+  }
+  const size_t num_rows =
+      repeaters == 0 ? 0 : (num_response_varbinds - non_repeaters) / repeaters;
+  ArenaVector<size_t> indices;
+  indices.reserve(non_repeaters + num_rows * repeaters);
+  for (size_t i = 0; i < non_repeaters; ++i) {
+    indices.push_back(canonical_positions[i]);
+  }
+  for (size_t row = 0; row < num_rows; ++row) {
+    for (size_t i = non_repeaters; i < num_varbinds; ++i) {
+      indices.push_back(non_repeaters + row * repeaters +
+                        canonical_positions[i] - non_repeaters);
+    }
+  }
+  ArenaString result =
+      SNMPSequence::SelectVarbinds(response_data, response_fields, indices);
+
+  // The error index points into the request's variable bindings.
+  const int64_t error_index = response_fields.error_index;
+  if (response_fields.error_status != 0 && error_index > 0 &&
+      uint64_t(error_index) <= num_varbinds) {
+    result.replace(
+        response_fields.error_index_offset,
+        response_fields.varbind_list_offset -
+            response_fields.error_index_offset,
+        SNMPSequence::EncodeASN1Integer(varbind_order[error_index - 1] + 1));
+  }
+  return result;
+}
+
+ArenaString SNMPProxy::TruncateBulkResponse(
+    const ArenaString& response_data,
+    const SNMPSequence::Fields& request_fields) {
+  SNMPSequence::Fields response_fields;
+  if (!SNMPSequence::ParseData(response_data, &response_fields)) {
+    return ArenaString(response_data.data(), response_data.size());
+  }
+
+  // The response holds one binding per non-repeater followed by up to
+  // max-repetitions rows of one binding per repeater (RFC 3416, 4.2.3).
+  const uint64_t num_varbinds = request_fields.varbinds.size();
+  const uint64_t non_repeaters = NonRepeaters(request_fields);
+  const uint64_t repeaters = num_varbinds - non_repeaters;
+  const uint64_t max_repetitions =
+      std::max<int64_t>(request_fields.error_index, 0);
+  const uint64_t num_response_varbinds =
+      non_repeaters + repeaters * max_repetitions;
+  if (response_fields.varbinds.size() <= num_response_varbinds) {
+    return ArenaString(response_data.data(), response_data.size());
+  }
+  ArenaVector<size_t> indices(num_response_varbinds);
+  for (size_t i = 0; i < indices.size(); ++i) {
+    indices[i] = i;
+  }
+  return SNMPSequence::SelectVarbinds(response_data, response_fields, indices);
+}
+
+int64_t SNMPProxy::NowMs() const {
+  return clock_ms_.load(std::memory_order_relaxed);
+}
+
+void SNMPProxy::TickClock() {
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(kClockTickMs));
+    clock_ms_.store(MonotonicMs(), std::memory_order_relaxed);
+  }
+}
+
+void SNMPProxy::ListenForTraps(udp::socket* socket) {
+  Arena arena;
+  boost::array<char, 65536> packet;
+  while (true) {
+    udp::endpoint remote_endpoint;
+    boost::system::error_code error;
+    const size_t packet_size =
+        socket->receive_from(boost::asio::buffer(packet), remote_endpoint, 0,
+                             error);
+    if (error) {
+      continue;
+    }
+    Arena::Scope scope(&arena);
+    ArenaString community;
+    size_t pdu_type_offset;
+    uint8_t pdu_type;
+    ArenaString data;
+    SNMPSequence::Fields fields;
+    if (!SNMPSequence::ParseNotification(packet.data(),
+                                         packet.data() + packet_size,
+                                         &community, &pdu_type_offset,
+                                         &pdu_type, &data) ||
+        community.compare(0, std::string::npos, trap_community_.data(),
+                          trap_community_.size()) != 0 ||
+        !SNMPSequence::ParseData(data, &fields)) {
+      continue;
+    }
+
+    // An inform is acknowledged with the same PDU as a response, which is
+    // the same size.
+    if (pdu_type == kInformRequestPDUType) {
+      packet[pdu_type_offset] = char(kGetResponsePDUType);
+      socket->send_to(boost::asio::buffer(packet.data(), packet_size),
+                      remote_endpoint, 0, error);
+    }
+
+    // The backend is the sender, unless a configured relay says who it
+    // forwarded the notification for. Others can't name a backend.
+    std::string backend = remote_endpoint.address().to_string();
+    const bool relay =
+        std::find(trap_relay_addresses_.begin(), trap_relay_addresses_.end(),
+                  remote_endpoint.address()) != trap_relay_addresses_.end();
+    const TrapInvalidation* invalidation = nullptr;
+    for (const std::pair<size_t, size_t>& varbind : fields.varbinds) {
+      const char* name;
+      uint64_t name_size;
+      const char* value;
+      uint64_t value_size;
+      uint8_t value_type;
+      if (!SNMPSequence::VarbindName(data, varbind, &name, &name_size) ||
+          !SNMPSequence::VarbindValue(data, varbind, &value, &value_size,
+                                      &value_type)) {
+        break;
+      }
+      const std::string variable(name, name_size);
+      if (variable == kSNMPTrapOID && value_type == kObjectIdentifierType) {
+        for (const TrapInvalidation& known : trap_invalidations_) {
+          if (known.notification.size() == value_size &&
+              memcmp(known.notification.data(), value, value_size) == 0) {
+            invalidation = &known;
+          }
+        }
+      } else if (relay && variable == kSNMPTrapAddress &&
+                 value_type == kIpAddressType && value_size == 4) {
+        boost::asio::ip::address_v4::bytes_type address;
+        memcpy(address.data(), value, address.size());
+        backend = boost::asio::ip::address_v4(address).to_string();
+      }
+    }
+    if (invalidation == nullptr) {
+      continue;
+    }
+
+    // Per-interface notifications name the interface by the instance of
+    // their variables in its row, such as ifIndex.<ifIndex>.
+    std::string instance;
+    if (invalidation->per_interface) {
+      const std::string& entry = invalidation->prefixes[0];
+      for (const std::pair<size_t, size_t>& varbind : fields.varbinds) {
+        const char* name;
+        uint64_t name_size;
+        if (SNMPSequence::VarbindName(data, varbind, &name, &name_size) &&
+            name_size > entry.size() &&
+            memcmp(name, entry.data(), entry.size()) == 0) {
+          const char* start = name + entry.size();
+          SNMPSequence::DecodeSubidentifier(&start, name + name_size);
+          instance.assign(start, name + name_size - start);
+          break;
+        }
+      }
+    }
+    const ArenaString backend_address(backend.data(), backend.size());
+    const size_t num_erased =
+        InvalidateBackend(backend_address, *invalidation, instance);
+    std::cout << "Invalidated " << num_erased << " cache entries of "
+              << backend << " on notification from "
+              << remote_endpoint.address() << "." << std::endl;
+  }
+}
+
+size_t SNMPProxy::InvalidateBackend(const ArenaString& backend_address,
+                                    const TrapInvalidation& invalidation,
+                                    const std::string& instance) {
+  auto invalidates = [&invalidation, &instance](const char* name,
+                                                uint64_t name_size) {
+    for (const std::string& prefix : invalidation.prefixes) {
+      if (name_size <= prefix.size() ||
+          memcmp(name, prefix.data(), prefix.size()) != 0) {
+        continue;
+      }
+      if (instance.empty()) {
+        return true;
+      }
+      const char* start = name + prefix.size();
+      SNMPSequence::DecodeSubidentifier(&start, name + name_size);
+      if (uint64_t(name + name_size - start) == instance.size() &&
+          memcmp(start, instance.data(), instance.size()) == 0) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  // A backend's entries share its partition with others', and notifications
+  // are rare enough to look through all of them rather than index them by
+  // backend.
+  Node* partition = CachePartition(backend_address);
+  size_t num_erased = 0;
+  {
+    std::lock_guard<std::mutex> lock(partition->cache_mutex);
+    Cache& cache = partition->cache;
+    for (uint32_t slot = 0; slot < cache.num_slots(); ++slot) {
+      const Cache::Entry* entry = cache.entry(slot);
+      if (entry == nullptr ||
+          !(entry->first.backend_address() == backend_address)) {
+        continue;
+      }
+      bool erase = invalidation.prefixes.empty();
+      const ArenaString& response_data = entry->second.response_data();
+      SNMPSequence::Fields fields;
+      if (!erase && SNMPSequence::ParseData(response_data, &fields)) {
+        for (const std::pair<size_t, size_t>& varbind : fields.varbinds) {
+          const char* name;
+          uint64_t name_size;
+          if (SNMPSequence::VarbindName(response_data, varbind, &name,
+                                        &name_size) &&
+              invalidates(name, name_size)) {
+            erase = true;
+            break;
+          }
+        }
+      }
+      if (erase) {
+        cache.Erase(slot);
+        ++num_erased;
+      }
+    }
+  }
+
+  // Snapshots of tables holding any of the variables are dropped whole, by
+  // the key they are stored under: the backend address, a NUL, and after
+  // the community, the table's index.
+  std::lock_guard<std::mutex> lock(snapshots_mutex_);
+  for (auto entry = snapshots_.begin(); entry != snapshots_.end();) {
+    const ArenaString& snapshot_key = entry->first;
+    bool drop = snapshot_key.size() > backend_address.size() &&
+                snapshot_key.compare(0, backend_address.size(),
+                                     backend_address) == 0 &&
+                snapshot_key[backend_address.size()] == '\0';
+    if (drop && !invalidation.prefixes.empty()) {
+      const std::string& table =
+          snapshot_tables_[uint8_t(snapshot_key.back())];
+      drop = false;
+      for (const std::string& prefix : invalidation.prefixes) {
+        const size_t size = std::min(prefix.size(), table.size());
+        drop = drop || memcmp(prefix.data(), table.data(), size) == 0;
+      }
+    }
+    if (!drop) {
+      ++entry;
+    } else if (entry->second.refreshing) {
+      // Whoever is refreshing the snapshot holds on to its slot.
+      entry->second.snapshot.reset();
+      ++entry;
+    } else {
+      entry = snapshots_.erase(entry);
+    }
+  }
+  return num_erased;
 }
 
 void SNMPProxy::EvictStaleCacheEntries() {
+  // When TTLs are learned, expired entries are kept as long again as the
+  // cache TTL, for the requests that refresh them to compare with, and
+  // columns are forgotten once none has been refreshed for twice the longest
+  // TTL.
+  const bool learn_ttls = min_cache_ttl_ms_ != max_cache_ttl_ms_;
+  const int64_t retention_ms = learn_ttls ? cache_ttl_ms_ : 0;
   while (true) {
     size_t num_evicted_entries = 0;
-    {
-      std::lock_guard<std::mutex> lock(mutex_);
-      const std::time_t current_time = std::time(nullptr);
-      for (auto entry = cache_.begin(); entry != cache_.end();) {
-        if (current_time > entry->second.time() + cache_ttl_sec_) {
-          entry = cache_.erase(entry);
-          ++num_evicted_entries;
+    const int64_t current_time = NowMs();
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      Node* node = nodes_[i].get();
+      std::lock_guard<std::mutex> lock(node->cache_mutex);
+      num_evicted_entries += node->cache.EraseExpiredBefore(
+          current_time - retention_ms);
+      for (auto column = node->column_volatility.begin();
+           column != node->column_volatility.end();) {
+        if (current_time > column->second.last_time + 2 * max_cache_ttl_ms_) {
+          column = node->column_volatility.erase(column);
         } else {
-          ++entry;
+          ++column;
         }
       }
+      LogCacheIndex(i, node->cache);
     }
     if (num_evicted_entries > 0) {
       std::cout << "Evicted " << num_evicted_entries << " stale cache entries."
                 << std::endl;
     }
-    std::this_thread::sleep_for(std::chrono::seconds(cache_ttl_sec_));
+    ReportRejectedRequests();
+    RefreshBackends();
+    EvictIdleWalkSessions();
+    EvictStaleSnapshots();
+    std::this_thread::sleep_for(std::chrono::milliseconds(
+        std::max(cache_ttl_ms_, kMinSweepIntervalMs)));
+  }
+}
+
+void SNMPProxy::LogCacheIndex(size_t partition_index, const Cache& cache) {
+  if (cache.size() == 0) {
+    return;
+  }
+  std::vector<size_t> histogram;
+  size_t longest_probe;
+  cache.ProbeLengths(&histogram, &longest_probe);
+  std::cout << "Cache partition " << partition_index << ": " << cache.size()
+            << " entries (" << cache.response_bytes() << " bytes) in "
+            << cache.index_size() << " index positions, longest probe "
+            << longest_probe << ", probe lengths";
+  for (size_t bucket = 0; bucket < histogram.size(); ++bucket) {
+    std::cout << (bucket == 0 ? " " : ", ");
+    const size_t first = bucket == 0 ? 1 : (size_t(1) << (bucket - 1)) + 1;
+    const size_t last = size_t(1) << bucket;
+    if (first == last) {
+      std::cout << first;
+    } else {
+      std::cout << first << "-" << last;
+    }
+    std::cout << ": " << histogram[bucket];
+  }
+  std::cout << "." << std::endl;
+}
+
+bool SNMPProxy::TakeOverSocket(udp::socket* socket) {
+  boost::asio::local::stream_protocol::socket handoff_socket(io_service_);
+  boost::system::error_code error;
+  handoff_socket.connect(
+      boost::asio::local::stream_protocol::endpoint(handoff_path_), error);
+  if (error) {
+    return false;
+  }
+
+  // The listening socket arrives as ancillary data alongside a single byte.
+  char byte;
+  iovec iov = {&byte, sizeof(byte)};
+  char control[CMSG_SPACE(sizeof(int))];
+  msghdr message = {};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  if (recvmsg(handoff_socket.native_handle(), &message, 0) != 1) {
+    std::cerr << "Could not receive socket from " << handoff_path_ << "."
+              << std::endl;
+    return false;
+  }
+  cmsghdr* control_message = CMSG_FIRSTHDR(&message);
+  if (control_message == nullptr || control_message->cmsg_level != SOL_SOCKET ||
+      control_message->cmsg_type != SCM_RIGHTS) {
+    std::cerr << "Could not receive socket from " << handoff_path_ << "."
+              << std::endl;
+    return false;
+  }
+  int fd;
+  memcpy(&fd, CMSG_DATA(control_message), sizeof(fd));
+  socket->assign(udp::v4(), fd, error);
+  if (error) {
+    std::cerr << "Could not take over socket: " << error.message()
+              << std::endl;
+    close(fd);
+    return false;
+  }
+
+  // The socket is ours from here on, so a truncated cache stream only costs
+  // cache warmth.
+  std::string cache;
+  boost::array<char, 65536> buffer;
+  while (true) {
+    const size_t size = handoff_socket.read_some(boost::asio::buffer(buffer),
+                                                 error);
+    if (error) {
+      break;
+    }
+    cache.append(buffer.data(), size);
+  }
+  if (error != boost::asio::error::eof || !DeserializeCache(cache)) {
+    std::cerr << "Could not load cache from " << handoff_path_ << "."
+              << std::endl;
+  }
+  size_t num_entries = 0;
+  for (const std::unique_ptr<Node>& node : nodes_) {
+    num_entries += node->cache.size();
+  }
+  std::cout << "Took over socket and " << num_entries
+            << " cache entries from " << handoff_path_ << "." << std::endl;
+  return true;
+}
+
+void SNMPProxy::HandOffSocket(
+    boost::asio::local::stream_protocol::acceptor* acceptor,
+    udp::socket* socket) {
+  while (true) {
+    boost::asio::local::stream_protocol::socket handoff_socket(io_service_);
+    boost::system::error_code error;
+    acceptor->accept(handoff_socket, error);
+    if (error) {
+      continue;
+    }
+
+    char byte = 0;
+    iovec iov = {&byte, sizeof(byte)};
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr* control_message = CMSG_FIRSTHDR(&message);
+    control_message->cmsg_level = SOL_SOCKET;
+    control_message->cmsg_type = SCM_RIGHTS;
+    control_message->cmsg_len = CMSG_LEN(sizeof(int));
+    const int fd = socket->native_handle();
+    memcpy(CMSG_DATA(control_message), &fd, sizeof(fd));
+    if (sendmsg(handoff_socket.native_handle(), &message, 0) != 1) {
+      std::cerr << "Could not hand off socket." << std::endl;
+      continue;
+    }
+
+    // Both processes now serve from the socket, so we can take our time
+    // streaming the cache.
+    const std::string cache = SerializeCache();
+    boost::asio::write(handoff_socket, boost::asio::buffer(cache), error);
+    if (error) {
+      std::cerr << "Could not hand off cache: " << error.message()
+                << std::endl;
+    }
+    break;
+  }
+  const char byte = 0;
+  if (write(handoff_pipe_[1], &byte, sizeof(byte)) != sizeof(byte)) {
+    std::cerr << "Could not stop serving after handoff." << std::endl;
+  }
+}
+
+std::string SNMPProxy::SerializeCache() {
+  std::string output;
+  AppendHandoffInt(kHandoffStreamVersion, &output);
+
+  // Partitions are serialized one at a time, each under only its own lock,
+  // so the count of entries ahead of them is filled in once they all are.
+  const size_t num_entries_offset = output.size();
+  uint64_t num_entries = 0;
+  AppendHandoffInt(num_entries, &output);
+  for (const std::unique_ptr<Node>& node : nodes_) {
+    std::lock_guard<std::mutex> lock(node->cache_mutex);
+    const Cache& cache = node->cache;
+    num_entries += cache.size();
+    for (uint32_t slot = 0; slot < cache.num_slots(); ++slot) {
+      const Cache::Entry* entry = cache.entry(slot);
+      if (entry == nullptr) {
+        continue;
+      }
+      entry->first.Serialize(&output);
+      AppendHandoffString(entry->second.response_data(), &output);
+      AppendHandoffInt(entry->second.max_repetitions(), &output);
+      AppendHandoffInt(cache.time(slot), &output);
+      AppendHandoffInt(cache.expiry_time(slot), &output);
+    }
+  }
+  memcpy(&output[num_entries_offset], &num_entries, sizeof(num_entries));
+  return output;
+}
+
+bool SNMPProxy::DeserializeCache(const std::string& input) {
+  const char* start = input.data();
+  const char* end = input.data() + input.size();
+  uint32_t version;
+  uint64_t num_entries;
+  if (!ReadHandoffInt(&start, end, &version) ||
+      version != kHandoffStreamVersion ||
+      !ReadHandoffInt(&start, end, &num_entries)) {
+    return false;
+  }
+  for (uint64_t i = 0; i < num_entries; ++i) {
+    std::unique_ptr<CacheKey> key;
+    ArenaString response_data;
+    int64_t max_repetitions;
+    int64_t time;
+    int64_t expiry_time;
+    if (!CacheKey::Deserialize(&start, end, &key) ||
+        !ReadHandoffString(&start, end, &response_data) ||
+        !ReadHandoffInt(&start, end, &max_repetitions) ||
+        !ReadHandoffInt(&start, end, &time) ||
+        !ReadHandoffInt(&start, end, &expiry_time)) {
+      return false;
+    }
+    Node* partition = CachePartition(key->backend_address());
+    std::lock_guard<std::mutex> lock(partition->cache_mutex);
+    if (partition->cache.Find(*key) == Cache::kNoSlot) {
+      partition->cache.Insert(*key, CacheValue(response_data, max_repetitions),
+                              time, expiry_time);
+    }
+  }
+  return true;
+}
+
+bool SNMPProxy::ServeFromSnapshot(
+    const udp::endpoint& remote_endpoint, const ArenaString& backend_host,
+    uint32_t client_address, const SNMPSequence& snmp_request,
+    const SNMPSequence::Fields& request_fields, int64_t repetitions,
+    BackendClient* backend_client, ArenaString* response,
+    std::shared_ptr<const TableSnapshot>* snapshot, bool* cache_hit) {
+  if (snapshot_tables_.empty() || repetitions <= 0 ||
+      request_fields.varbinds.empty()) {
+    return false;
+  }
+
+  // Every variable named must be in the same table.
+  ArenaVector<std::pair<const char*, uint64_t>> names;
+  for (const std::pair<size_t, size_t>& varbind : request_fields.varbinds) {
+    const char* name;
+    uint64_t name_size;
+    if (!SNMPSequence::VarbindName(snmp_request.data(), varbind, &name,
+                                   &name_size)) {
+      return false;
+    }
+    names.emplace_back(name, name_size);
+  }
+  size_t table_index = 0;
+  for (; table_index < snapshot_tables_.size(); ++table_index) {
+    const std::string& table = snapshot_tables_[table_index];
+    bool in_table = true;
+    for (const std::pair<const char*, uint64_t>& name : names) {
+      if (name.second < table.size() ||
+          memcmp(name.first, table.data(), table.size()) != 0) {
+        in_table = false;
+        break;
+      }
+    }
+    if (in_table) {
+      break;
+    }
+  }
+  if (table_index == snapshot_tables_.size()) {
+    return false;
+  }
+
+  // As in GetResponse(), resolving a backend makes the request a miss.
+  udp::endpoint backend_endpoint;
+  ArenaString snapshot_key;
+  const bool resolved =
+      FindBackend(backend_host, &backend_endpoint, &snapshot_key);
+  if (!resolved &&
+      !ResolveBackend(backend_host, &backend_endpoint, &snapshot_key)) {
+    return false;
+  }
+  snapshot_key += '\0';
+  snapshot_key += snmp_request.community();
+  snapshot_key += snmp_request.community_index();
+  snapshot_key += '\0';
+  snapshot_key += char(table_index);
+
+  // A walk stays on the snapshot it started on, even once it is stale or
+  // replaced.
+  {
+    std::lock_guard<std::mutex> lock(walk_sessions_mutex_);
+    const uint64_t session_key = WalkSessionKey(remote_endpoint);
+    const WalkSession* session =
+        walk_sessions_[WalkSessionSlot(session_key)].get();
+    if (session != nullptr && session->key == session_key &&
+        session->snapshot &&
+        session->snapshot->key.compare(
+            0, std::string::npos, snapshot_key.data(),
+            snapshot_key.size()) == 0 &&
+        ContinuesWalk(*session, backend_host, snmp_request)) {
+      *snapshot = session->snapshot;
+    }
+  }
+  bool fetched = false;
+  if (!*snapshot) {
+    *snapshot = GetSnapshot(snapshot_key, table_index, backend_host,
+                            client_address, backend_endpoint, snmp_request,
+                            backend_client, &fetched);
+    if (!*snapshot) {
+      return false;
+    }
+  }
+
+  // Each repetition is the row after the previous one for each variable.
+  // Repetitions that would run past the end of the table are left out, and
+  // the client asks the backend for them.
+  ArenaVector<FrontCodedTable::Cursor> cursors;
+  ArenaVector<TypedColumns::Cursor> number_cursors;
+  for (const std::pair<const char*, uint64_t>& name : names) {
+    cursors.emplace_back(&(*snapshot)->rows);
+    cursors.back().SeekPast(name.first, name.second);
+    number_cursors.emplace_back(&(*snapshot)->numbers);
+  }
+  ArenaString varbind_list;
+  for (int64_t i = 0; i < repetitions; ++i) {
+    // Each variable binding takes up at most eight bytes more than its name
+    // and value.
+    size_t repetition_size = 0;
+    bool in_table = true;
+    for (const FrontCodedTable::Cursor& cursor : cursors) {
+      if (!cursor.valid()) {
+        in_table = false;
+        break;
+      }
+      repetition_size += cursor.name().size() + 8 +
+                         (cursor.value_size() > 0 ?
+                              cursor.value_size() :
+                              TypedColumns::kMaxValueSize);
+    }
+    if (!in_table ||
+        varbind_list.size() + repetition_size > kMaxSnapshotResponseSize) {
+      break;
+    }
+    for (size_t j = 0; j < cursors.size(); ++j) {
+      FrontCodedTable::Cursor& cursor = cursors[j];
+      char number[TypedColumns::kMaxValueSize];
+      const char* value = cursor.value();
+      size_t value_size = cursor.value_size();
+      if (value_size == 0) {
+        value = number;
+        value_size = number_cursors[j].Encode(cursor.row(), number);
+      }
+      SNMPSequence::AppendVarbind(cursor.name().data(), cursor.name().size(),
+                                  value, value_size, &varbind_list);
+      cursor.Next();
+    }
+  }
+  if (varbind_list.empty()) {
+    return false;
+  }
+
+  SNMPSequence snmp_response(snmp_request);
+  snmp_response.set_community(backend_host);
+  snmp_response.set_pdu_type(kGetResponsePDUType);
+  snmp_response.set_data(SNMPSequence::BuildData(0, 0, varbind_list));
+  *response = snmp_response.Serialize();
+  *cache_hit = resolved && !fetched;
+  return true;
+}
+
+std::shared_ptr<const SNMPProxy::TableSnapshot> SNMPProxy::GetSnapshot(
+    const ArenaString& snapshot_key, size_t table_index,
+    const ArenaString& backend_host, uint32_t client_address,
+    const udp::endpoint& backend_endpoint, const SNMPSequence& snmp_request,
+    BackendClient* backend_client, bool* fetched) {
+  // Slots are only evicted when nobody is refreshing them.
+  SnapshotSlot* slot;
+  {
+    std::lock_guard<std::mutex> lock(snapshots_mutex_);
+    auto entry = snapshots_.find(snapshot_key);
+    if (entry == snapshots_.end()) {
+      entry = snapshots_.emplace(
+          ArenaString(snapshot_key, ArenaAllocator<char>(nullptr)),
+          SnapshotSlot()).first;
+    }
+    slot = &entry->second;
+    if ((slot->snapshot &&
+         NowMs() <= slot->snapshot->time + cache_ttl_ms_) ||
+        slot->refreshing) {
+      return slot->snapshot;
+    }
+    slot->refreshing = true;
+  }
+  *fetched = true;
+
+  std::shared_ptr<const TableSnapshot> snapshot;
+  {
+    ClientMiss client_miss(this, client_address);
+    if (client_miss.admitted()) {
+      snapshot = FetchSnapshot(snapshot_key, table_index, backend_host,
+                               backend_endpoint, snmp_request, backend_client);
+    }
+  }
+  std::lock_guard<std::mutex> lock(snapshots_mutex_);
+  slot->refreshing = false;
+  if (snapshot) {
+    slot->snapshot = snapshot;
+  }
+  return snapshot;
+}
+
+std::shared_ptr<const SNMPProxy::TableSnapshot> SNMPProxy::FetchSnapshot(
+    const ArenaString& snapshot_key, size_t table_index,
+    const ArenaString& backend_host, const udp::endpoint& backend_endpoint,
+    const SNMPSequence& snmp_request, BackendClient* backend_client) {
+  const std::chrono::steady_clock::time_point start_time =
+      std::chrono::steady_clock::now();
+
+  // Find the table's columns, skipping from the first variable of each to
+  // the next. Like FetchRange(), each query has an arena of the fetch's own
+  // for its temporaries, so that they don't pile up in this thread's.
+  std::string entry = snapshot_tables_[table_index];
+  SNMPSequence::AppendSubidentifier(1, &entry);
+  std::vector<std::string> columns;
+  std::string name = entry;
+  SNMPSequence query(snmp_request);
+  Arena arena;
+  while (true) {
+    Arena::Scope scope(&arena);
+    const ArenaString data = QueryNext(backend_client, backend_endpoint,
+                                       &query, kGetNextRequestPDUType, 0,
+                                       name);
+    SNMPSequence::Fields fields;
+    const char* next;
+    uint64_t next_size;
+    uint8_t value_type;
+    if (data.empty() || !SNMPSequence::ParseData(data, &fields) ||
+        fields.error_status != 0 || fields.varbinds.size() != 1 ||
+        !SNMPSequence::VarbindName(data, fields.varbinds[0], &next,
+                                   &next_size, &value_type)) {
+      return nullptr;
+    }
+    if (value_type == kEndOfMibViewType || next_size <= entry.size() ||
+        memcmp(next, entry.data(), entry.size()) != 0) {
+      break;
+    }
+    const char* position = next + entry.size();
+    const uint64_t column =
+        SNMPSequence::DecodeSubidentifier(&position, next + next_size);
+    columns.push_back(entry);
+    SNMPSequence::AppendSubidentifier(column, &columns.back());
+    name = entry;
+    SNMPSequence::AppendSubidentifier(column + 1, &name);
+  }
+
+  // Learn the indices of the table's rows from its first column, and split
+  // the others at them into ranges of about as many rows as there are
+  // chains the backend may be walked with.
+  const std::string host(backend_host.data(), backend_host.size());
+  if (columns.empty()) {
+    return nullptr;
+  }
+  ColumnRange first_column;
+  first_column.start = columns[0];
+  first_column.max_repetitions = kSnapshotMaxRepetitions;
+  {
+    BackendWalk backend_walk(this, host);
+    first_column.fetched = FetchRange(backend_client, backend_endpoint,
+                                      columns[0], &query, &first_column);
+  }
+  const std::vector<ColumnRange::Row>& first_rows = first_column.rows;
+  const size_t num_splits =
+      std::max<size_t>(std::min<size_t>(first_rows.size() / kMinRowsPerRange,
+                                        max_walks_per_backend_), 1);
+  std::vector<ColumnRange> ranges;
+  std::vector<size_t> range_columns;
+  for (size_t i = 1; first_column.fetched && i < columns.size(); ++i) {
+    for (size_t split = 0; split < num_splits; ++split) {
+      const size_t begin_row = first_rows.size() * split / num_splits;
+      const size_t end_row = first_rows.size() * (split + 1) / num_splits;
+      ranges.emplace_back();
+      range_columns.push_back(i);
+      ColumnRange& range = ranges.back();
+      range.start = columns[i];
+      if (begin_row > 0) {
+        range.start.append(first_rows[begin_row - 1].name, columns[0].size(),
+                           std::string::npos);
+      }
+      if (split + 1 < num_splits) {
+        range.last = columns[i];
+        range.last.append(first_rows[end_row - 1].name, columns[0].size(),
+                          std::string::npos);
+      }
+      range.max_repetitions =
+          std::min<int64_t>(end_row - begin_row + 1, kSnapshotMaxRepetitions);
+      range.fetched = false;
+    }
+  }
+
+  // This thread walks ranges too, helped by as many threads as the backend
+  // may be walked with, or as are left in the budget, so a fetch goes on
+  // even when other fetches have taken all of it.
+  std::atomic<size_t> next_range(0);
+  auto walk_ranges = [this, &backend_endpoint, &host, &columns, &ranges,
+                      &range_columns, &next_range](
+      BackendClient* backend_client, SNMPSequence* query) {
+    for (size_t range = next_range++; range < ranges.size();
+         range = next_range++) {
+      BackendWalk backend_walk(this, host);
+      ranges[range].fetched =
+          FetchRange(backend_client, backend_endpoint,
+                     columns[range_columns[range]], query, &ranges[range]);
+    }
+  };
+  unsigned int num_helpers =
+      std::min<size_t>(ranges.size(), max_walks_per_backend_);
+  num_helpers = num_helpers > 0 ? num_helpers - 1 : 0;
+  {
+    std::lock_guard<std::mutex> lock(backend_walks_mutex_);
+    num_helpers = std::min(num_helpers, kMaxWalkThreads - num_walk_threads_);
+    num_walk_threads_ += num_helpers;
+  }
+
+  // The request is shared with the helpers serialized, since its strings are
+  // in this thread's arena.
+  const ArenaString serialized_request = snmp_request.Serialize();
+  const std::string request(serialized_request.data(),
+                            serialized_request.size());
+  std::vector<std::thread> walk_threads;
+  for (unsigned int i = 0; i < num_helpers; ++i) {
+    walk_threads.emplace_back([this, &request, &walk_ranges] {
+      BackendClient backend_client;
+      SNMPSequence query(request.data(), request.data() + request.size());
+      if (!query.initialized()) {
+        return;
+      }
+
+      // The request was serialized with the community index as part of the
+      // community.
+      UseBackendCommunity(&query);
+      walk_ranges(&backend_client, &query);
+    });
+  }
+  walk_ranges(backend_client, &query);
+  for (std::thread& walk_thread : walk_threads) {
+    walk_thread.join();
+  }
+  {
+    std::lock_guard<std::mutex> lock(backend_walks_mutex_);
+    num_walk_threads_ -= num_helpers;
+  }
+
+  // Columns are in OID order, and so are their ranges and the rows in them.
+  std::shared_ptr<TableSnapshot> snapshot(new TableSnapshot);
+  snapshot->key.assign(snapshot_key.data(), snapshot_key.size());
+  snapshot->time = NowMs();
+  bool fetched = first_column.fetched;
+  for (size_t i = 0; fetched && i <= ranges.size(); ++i) {
+    const ColumnRange& range = i == 0 ? first_column : ranges[i - 1];
+    fetched = range.fetched;
+    for (const ColumnRange::Row& row : range.rows) {
+      if (snapshot->numbers.Append(snapshot->rows.size(), row.value.data(),
+                                   row.value.size())) {
+        snapshot->rows.Append(row.name.data(), row.name.size(), nullptr, 0);
+      } else {
+        snapshot->rows.Append(row.name.data(), row.name.size(),
+                              row.value.data(), row.value.size());
+      }
+    }
+  }
+  snapshot->rows.ShrinkToFit();
+  snapshot->numbers.ShrinkToFit();
+  if (!fetched) {
+    std::cerr << "Could not fetch table " << snapshot_table_oids_[table_index]
+              << " from " << backend_host << "." << std::endl;
+    return nullptr;
+  }
+  std::cout << "Fetched " << snapshot->rows.size() << " variables ("
+            << snapshot->rows.memory_size() +
+                   snapshot->numbers.memory_size()
+            << " bytes) in "
+            << columns.size() << " columns of " << num_splits
+            << " ranges each of table "
+            << snapshot_table_oids_[table_index] << " from " << backend_host
+            << " in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - start_time).count()
+            << " ms." << std::endl;
+  return snapshot;
+}
+
+bool SNMPProxy::FetchRange(BackendClient* backend_client,
+                           const udp::endpoint& backend_endpoint,
+                           const std::string& column, SNMPSequence* query,
+                           ColumnRange* range) {
+  // A walk takes as many queries as the range has rows over their
+  // max-repetitions, so their temporaries go in an arena that is reset after
+  // each, rather than in the calling thread's, which would keep them all
+  // until the fetch is over, and then keep a block as big for good.
+  Arena arena;
+  std::string name = range->start;
+  while (true) {
+    Arena::Scope scope(&arena);
+    const ArenaString data =
+        QueryNext(backend_client, backend_endpoint, query,
+                  kGetBulkRequestPDUType, range->max_repetitions, name);
+    SNMPSequence::Fields fields;
+    if (data.empty() || !SNMPSequence::ParseData(data, &fields) ||
+        fields.error_status != 0 || fields.varbinds.empty()) {
+      return false;
+    }
+    for (const std::pair<size_t, size_t>& varbind : fields.varbinds) {
+      const char* next;
+      uint64_t next_size;
+      uint8_t value_type;
+      if (!SNMPSequence::VarbindName(data, varbind, &next, &next_size,
+                                     &value_type)) {
+        return false;
+      }
+      if (value_type == kEndOfMibViewType || next_size <= column.size() ||
+          memcmp(next, column.data(), column.size()) != 0) {
+        return true;
+      }
+
+      // Don't loop forever on backends that go backwards.
+      if (SNMPSequence::CompareOIDs(next, next_size, name.data(),
+                                    name.size()) <= 0) {
+        return false;
+      }
+      const int past_last =
+          range->last.empty() ? -1 :
+          SNMPSequence::CompareOIDs(next, next_size, range->last.data(),
+                                    range->last.size());
+      if (past_last > 0) {
+        return true;
+      }
+      range->rows.push_back({std::string(next, next_size),
+                             std::string(next + next_size,
+                                         data.data() + varbind.first +
+                                             varbind.second)});
+      if (past_last == 0) {
+        return true;
+      }
+      name.assign(next, next_size);
+    }
+  }
+}
+
+ArenaString SNMPProxy::QueryNext(BackendClient* backend_client,
+                                 const udp::endpoint& backend_endpoint,
+                                 SNMPSequence* query, uint8_t pdu_type,
+                                 int64_t max_repetitions,
+                                 const std::string& name) {
+  ArenaString varbind_list;
+  SNMPSequence::AppendNullVarbind(name.data(), name.size(), &varbind_list);
+  query->set_pdu_type(pdu_type);
+  query->set_data(SNMPSequence::BuildData(0, max_repetitions, varbind_list));
+  boost::array<char, 65536> response;
+  size_t response_size = 0;
+  for (unsigned int num_retries = 0;
+       num_retries <= num_backend_retries_ && response_size == 0;
+       ++num_retries) {
+    response_size = QueryBackend(backend_client, backend_endpoint, *query,
+                                 &response);
+  }
+  SNMPSequence snmp_response(response.data(), response.data() + response_size);
+  if (response_size == 0 || !snmp_response.initialized()) {
+    return ArenaString();
+  }
+  return snmp_response.data();
+}
+
+void SNMPProxy::EvictStaleSnapshots() {
+  std::lock_guard<std::mutex> lock(snapshots_mutex_);
+  const int64_t current_time = NowMs();
+  for (auto entry = snapshots_.begin(); entry != snapshots_.end();) {
+    if (!entry->second.refreshing &&
+        (!entry->second.snapshot ||
+         current_time > entry->second.snapshot->time + cache_ttl_ms_)) {
+      entry = snapshots_.erase(entry);
+    } else {
+      ++entry;
+    }
+  }
+}
+
+uint64_t SNMPProxy::WalkSessionKey(const udp::endpoint& remote_endpoint) {
+  return (uint64_t(remote_endpoint.address().to_v4().to_ulong()) << 16) |
+         remote_endpoint.port();
+}
+
+size_t SNMPProxy::WalkSessionSlot(uint64_t session_key) {
+  return HashBytes((const char*)&session_key, sizeof(session_key)) %
+         kNumWalkSessionSlots;
+}
+
+bool SNMPProxy::ContinuesWalk(const WalkSession& session,
+                              const ArenaString& backend_host,
+                              const SNMPSequence& snmp_request) {
+  const ArenaString& request_data = snmp_request.data();
+  return !session.next_data.empty() &&
+         session.pdu_type == snmp_request.pdu_type() &&
+         session.backend_host.compare(0, std::string::npos,
+                                      backend_host.data(),
+                                      backend_host.size()) == 0 &&
+         session.next_data.compare(0, std::string::npos, request_data.data(),
+                                   request_data.size()) == 0;
+}
+
+void SNMPProxy::TrackWalk(
+    const udp::endpoint& remote_endpoint, const ArenaString& backend_host,
+    const SNMPSequence& snmp_request,
+    const SNMPSequence::Fields& request_fields, const ArenaString& response,
+    const std::shared_ptr<const TableSnapshot>& snapshot, bool cache_hit) {
+  ArenaString next_data;
+  SNMPSequence snmp_response(response.data(),
+                             response.data() + response.size());
+  if (!snmp_response.initialized() ||
+      !SNMPSequence::ContinueWalk(snmp_request.data(), request_fields,
+                                  snmp_response.data(), &next_data)) {
+    next_data.clear();
+  }
+  const ArenaString request = snmp_request.Serialize();
+  const uint64_t session_key = WalkSessionKey(remote_endpoint);
+  const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+
+  std::lock_guard<std::mutex> lock(walk_sessions_mutex_);
+
+  // A new walk takes over its slot, unless the session there is being
+  // prefetched, or takes a spare session. Only a miss may allocate one.
+  std::unique_ptr<WalkSession>& slot =
+      walk_sessions_[WalkSessionSlot(session_key)];
+  if (!slot || slot->key != session_key) {
+    if (slot && slot->prefetching) {
+      return;
+    }
+    if (!slot && !spare_walk_sessions_.empty()) {
+      slot = std::move(spare_walk_sessions_.back());
+      spare_walk_sessions_.pop_back();
+    } else if (!slot) {
+      if (cache_hit) {
+        return;
+      }
+      slot.reset(new WalkSession);
+    }
+    slot->key = session_key;
+    slot->next_data.clear();
+  }
+  WalkSession& session = *slot;
+  const bool continued = ContinuesWalk(session, backend_host, snmp_request);
+  if (continued) {
+    const std::chrono::steady_clock::duration request_gap =
+        now - session.last_request_time;
+    session.request_gap = session.request_gap.count() == 0 ?
+        request_gap :
+        session.request_gap + (request_gap - session.request_gap) / 4;
+  } else {
+    session.request_gap = session.fetch_time =
+        std::chrono::steady_clock::duration::zero();
+  }
+  // A walk whose strings outgrow the room reserved for them isn't continued.
+  session.pdu_type = snmp_request.pdu_type();
+  if (!AssignReserved(backend_host.data(), backend_host.size(),
+                      &session.backend_host) ||
+      !AssignReserved(request.data(), request.size(), &session.request) ||
+      !AssignReserved(next_data.data(), next_data.size(),
+                      &session.next_data)) {
+    session.next_data.clear();
+    next_data.clear();
+  }
+  session.last_request_time = now;
+  session.snapshot = snapshot;
+  if (!continued || next_data.empty() || session.prefetching || snapshot ||
+      max_prefetch_depth_ == 0) {
+    return;
+  }
+
+  // Until the backend has been timed, prefetch one request ahead.
+  session.prefetch_depth = 1;
+  if (session.fetch_time.count() > 0) {
+    session.prefetch_depth = session.request_gap.count() == 0 ?
+        max_prefetch_depth_ :
+        std::min<uint64_t>(max_prefetch_depth_,
+                           (session.fetch_time + session.request_gap -
+                            std::chrono::steady_clock::duration(1)) /
+                               session.request_gap);
+    session.prefetch_depth = std::max(session.prefetch_depth, 1u);
+  }
+  if (!prefetch_queue_.TryEnqueue(session_key)) {
+    return;
+  }
+  session.prefetching = true;
+  {
+    std::lock_guard<std::mutex> lock(prefetch_mutex_);
+  }
+  prefetch_cv_.notify_one();
+}
+
+void SNMPProxy::PrefetchWalks() {
+  Arena arena;
+  BackendClient backend_client;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(prefetch_mutex_);
+      prefetch_cv_.wait(lock, [this] { return !prefetch_queue_.Empty(); });
+    }
+    uint64_t session_key;
+    if (!prefetch_queue_.TryDequeue(&session_key)) {
+      continue;
+    }
+
+    // Sessions aren't evicted while they are being prefetched.
+    Arena::Scope scope(&arena);
+    ArenaString backend_host, request, next_data;
+    unsigned int depth;
+    {
+      std::lock_guard<std::mutex> lock(walk_sessions_mutex_);
+      const WalkSession& session =
+          *walk_sessions_[WalkSessionSlot(session_key)];
+      backend_host.assign(session.backend_host.data(),
+                          session.backend_host.size());
+      request.assign(session.request.data(), session.request.size());
+      next_data.assign(session.next_data.data(), session.next_data.size());
+      depth = session.prefetch_depth;
+    }
+
+    // The request was serialized with the community index as part of the
+    // community.
+    std::chrono::steady_clock::duration fetch_time =
+        std::chrono::steady_clock::duration::zero();
+    SNMPSequence snmp_request(request.data(), request.data() + request.size());
+    if (snmp_request.initialized()) {
+      UseBackendCommunity(&snmp_request);
+      snmp_request.set_data(next_data);
+      const uint32_t client_address = session_key >> 16;
+      if (snmp_request.pdu_type() == kGetNextRequestPDUType) {
+        fetch_time = PrefetchWalk<GetNextPDU>(backend_host, client_address,
+                                              depth, &snmp_request,
+                                              &backend_client);
+      } else if (snmp_request.pdu_type() == kGetBulkRequestPDUType) {
+        fetch_time = PrefetchWalk<GetBulkPDU>(backend_host, client_address,
+                                              depth, &snmp_request,
+                                              &backend_client);
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(walk_sessions_mutex_);
+    WalkSession& session = *walk_sessions_[WalkSessionSlot(session_key)];
+    session.prefetching = false;
+    if (fetch_time.count() > 0) {
+      session.fetch_time = session.fetch_time.count() == 0 ?
+          fetch_time :
+          session.fetch_time + (fetch_time - session.fetch_time) / 4;
+    }
+  }
+}
+
+template <typename PDU>
+std::chrono::steady_clock::duration SNMPProxy::PrefetchWalk(
+    const ArenaString& backend_host, uint32_t client_address,
+    unsigned int depth, SNMPSequence* snmp_request,
+    BackendClient* backend_client) {
+  std::chrono::steady_clock::duration fetch_time =
+      std::chrono::steady_clock::duration::zero();
+  unsigned int num_fetches = 0;
+  for (unsigned int i = 0; i < depth; ++i) {
+    SNMPSequence::Fields request_fields;
+    if (!SNMPSequence::ParseData(snmp_request->data(), &request_fields)) {
+      break;
+    }
+
+    const std::chrono::steady_clock::time_point start_time =
+        std::chrono::steady_clock::now();
+    bool cache_hit;
+    const ArenaString response =
+        GetResponse<PDU>(backend_host, client_address, *snmp_request,
+                         request_fields, backend_client, &cache_hit, true);
+    if (!cache_hit) {
+      fetch_time += std::chrono::steady_clock::now() - start_time;
+      ++num_fetches;
+    }
+
+    SNMPSequence snmp_response(response.data(),
+                               response.data() + response.size());
+    ArenaString next_data;
+    if (!snmp_response.initialized() ||
+        !SNMPSequence::ContinueWalk(snmp_request->data(), request_fields,
+                                    snmp_response.data(), &next_data)) {
+      break;
+    }
+    snmp_request->set_data(next_data);
+  }
+  return num_fetches > 0 ? fetch_time / num_fetches : fetch_time;
+}
+
+void SNMPProxy::EvictIdleWalkSessions() {
+  const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  size_t num_spare_walk_sessions;
+  {
+    std::lock_guard<std::mutex> lock(walk_sessions_mutex_);
+    for (size_t i = 0; i < kNumWalkSessionSlots; ++i) {
+      std::unique_ptr<WalkSession>& slot = walk_sessions_[i];
+      if (!slot || slot->prefetching ||
+          now - slot->last_request_time <=
+              std::chrono::milliseconds(cache_ttl_ms_)) {
+        continue;
+      }
+      if (spare_walk_sessions_.size() < kNumSpareWalkSessions) {
+        slot->snapshot.reset();
+        spare_walk_sessions_.push_back(std::move(slot));
+      } else {
+        slot.reset();
+      }
+    }
+    num_spare_walk_sessions = spare_walk_sessions_.size();
+  }
+
+  // New sessions are made without the lock.
+  std::vector<std::unique_ptr<WalkSession>> walk_sessions;
+  while (num_spare_walk_sessions + walk_sessions.size() <
+         kNumSpareWalkSessions) {
+    walk_sessions.emplace_back(new WalkSession);
+  }
+  if (walk_sessions.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(walk_sessions_mutex_);
+  spare_walk_sessions_.reserve(kNumSpareWalkSessions);
+  for (std::unique_ptr<WalkSession>& walk_session : walk_sessions) {
+    if (spare_walk_sessions_.size() == kNumSpareWalkSessions) {
+      break;
+    }
+    spare_walk_sessions_.push_back(std::move(walk_session));
+  }
+}
+
+SNMPProxy::PrefetchedKey::PrefetchedKey(Node* partition, uint64_t key_hash) :
+    partition_(partition), key_hash_(key_hash), marked_(false) {}
+
+SNMPProxy::PrefetchedKey::~PrefetchedKey() {
+  if (!marked_) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(partition_->cache_mutex);
+    partition_->keys_prefetching.erase(key_hash_);
+  }
+  partition_->prefetched_cv.notify_all();
+}
+
+void SNMPProxy::PrefetchedKey::Mark() {
+  partition_->keys_prefetching.insert(key_hash_);
+  marked_ = true;
+}
+
+SNMPProxy::TableSnapshot::TableSnapshot() :
+    time(0), rows(&SNMPSequence::CompareOIDs) {}
+
+SNMPProxy::SnapshotSlot::SnapshotSlot() : refreshing(false) {}
+
+SNMPProxy::WalkSession::WalkSession() :
+    key(0), pdu_type(0),
+    request_gap(std::chrono::steady_clock::duration::zero()),
+    fetch_time(std::chrono::steady_clock::duration::zero()),
+    prefetch_depth(1), prefetching(false) {
+  backend_host.reserve(kWalkSessionStringSize);
+  request.reserve(kWalkSessionStringSize);
+  next_data.reserve(kWalkSessionStringSize);
+}
+
+void SNMPProxy::ReportRejectedRequests() {
+  const size_t num_rejected_requests = num_rejected_requests_.exchange(0);
+  const size_t num_dropped_requests = num_dropped_requests_.exchange(0);
+  if (num_rejected_requests > 0) {
+    std::cout << "Rejected " << num_rejected_requests
+              << " requests from clients over their limits." << std::endl;
+  }
+  if (num_dropped_requests > 0) {
+    std::cout << "Dropped " << num_dropped_requests
+              << " requests with all workers busy." << std::endl;
   }
 }
@@ -22,117 +22,1072 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstdint>
-#include <ctime>
+#include <deque>
+#include <memory>
 #include <mutex>
+#include <random>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "allocation_counter.h"
+#include "arena.h"
+#include "bloom_filter.h"
+#include "front_coded_table.h"
+#include "handler_memory.h"
+#include "hash.h"
+#include "mpmc_queue.h"
+#include "typed_columns.h"
+#include "xdp_socket.h"
 
 using boost::asio::ip::udp;
 
 class SNMPProxy {
  public:
   SNMPProxy(uint16_t port, const std::string& backend_community,
-            std::time_t backend_timeout_sec, unsigned int num_backend_retries,
-            std::time_t cache_ttl_sec);
+            int64_t backend_timeout_ms, unsigned int num_backend_retries,
+            int64_t cache_ttl_ms, const std::string& handoff_path,
+            double client_requests_per_sec, unsigned int client_burst,
+            unsigned int max_client_misses, bool reject_over_limit,
+            const std::string& xdp_interface, uint32_t xdp_queue,
+            unsigned int num_workers, unsigned int queue_size,
+            int64_t admission_window_ms,
+            const std::vector<std::string>& always_cache_oids,
+            unsigned int max_prefetch_depth,
+            const std::vector<std::string>& snapshot_tables,
+            unsigned int max_walks_per_backend,
+            unsigned int near_cache_size, int64_t min_cache_ttl_ms,
+            int64_t max_cache_ttl_ms, uint16_t trap_port,
+            const std::string& trap_community,
+            const std::vector<std::string>& trap_relays);
   bool Start();
 
  private:
+  struct StringHash {
+    size_t operator()(const ArenaString& input) const;
+  };
+
   class SNMPSequence {
    public:
+    // Where the parts of an SNMP sequence are in a Layer-4 payload, and what
+    // was decoded on the way to them, so that a payload parsed once can be
+    // made into a sequence again without parsing it.
+    struct Offsets {
+      uint64_t length;
+      uint32_t community_offset;
+      uint32_t community_size;
+      uint32_t community_index_size;
+      uint8_t pdu_type;
+      uint64_t pdu_length;
+      uint32_t request_id;
+      uint32_t data_offset;
+    };
+
     // Parses a Layer-4 payload into an SNMP sequence.
     SNMPSequence(const char* start, const char* end);
 
+    // Makes a sequence out of a Layer-4 payload that Parse() has parsed.
+    SNMPSequence(const char* start, const char* end, const Offsets& offsets);
+
+    // Parses a Layer-4 payload into the offsets of its parts. Returns false
+    // if it isn't an SNMPv2c sequence.
+    static bool Parse(const char* start, const char* end, Offsets* offsets);
+
+    // Finds the community and PDU type of an SNMPv2c trap or inform in a
+    // Layer-4 payload, the PDU type's offset, and the PDU data, everything
+    // after the request ID. Returns false if the payload is neither.
+    static bool ParseNotification(const char* start, const char* end,
+                                  ArenaString* community,
+                                  size_t* pdu_type_offset, uint8_t* pdu_type,
+                                  ArenaString* data);
+
     bool initialized() const;
-    const std::string& community() const;
-    const std::string& community_index() const;
+    const ArenaString& community() const;
+    const ArenaString& community_index() const;
     uint8_t pdu_type() const;
     uint32_t request_id() const;
-    const std::string& data() const;
+    const ArenaString& data() const;
 
-    void set_community(const std::string& community);
+    void set_community(const ArenaString& community);
     void set_pdu_type(uint8_t pdu_type);
+    void set_request_id(uint32_t request_id);
     void set_error(uint8_t error);
-    void set_data(const std::string& data);
+    void set_data(const ArenaString& data);
 
     // Serializes the sequence into a Layer-4 payload suitable for sending over 
     // the network.
-    std::string Serialize() const;
+    ArenaString Serialize() const;
+
+    // Fields of the PDU data that follow the request ID. For GetBulk
+    // requests, the error status and error index hold non-repeaters and
+    // max-repetitions, respectively.
+    struct Fields {
+      int64_t error_status;
+      int64_t error_index;
+
+      // Offset of the error index TLV.
+      size_t error_index_offset;
+
+      // Offset of the variable binding list TLV.
+      size_t varbind_list_offset;
+
+      // Offset and size of each variable binding TLV.
+      ArenaVector<std::pair<size_t, size_t>> varbinds;
+    };
+
+    // Parses PDU data, as returned by data(). Returns false if it is
+    // malformed.
+    static bool ParseData(const ArenaString& data, Fields* fields);
+
+    // Whether the variable bindings of response PDU data name what those of
+    // request PDU data asked for: the same variables for Get requests, and
+    // ones at or after them for GetNext and GetBulk requests. Request data
+    // that doesn't parse is answered by anything.
+    static bool ResponseAnswers(uint8_t pdu_type,
+                                const ArenaString& request_data,
+                                const ArenaString& response_data);
+
+    // Finds the name of a variable binding, the value of its OBJECT
+    // IDENTIFIER, in PDU data, and optionally the type of its value.
+    static bool VarbindName(const ArenaString& data,
+                            const std::pair<size_t, size_t>& varbind,
+                            const char** name, uint64_t* size,
+                            uint8_t* value_type = nullptr);
+
+    // Finds the value of a variable binding in PDU data, and its type.
+    static bool VarbindValue(const ArenaString& data,
+                             const std::pair<size_t, size_t>& varbind,
+                             const char** value, uint64_t* size,
+                             uint8_t* value_type);
+
+    // Encodes a dotted OBJECT IDENTIFIER into the value of an ASN.1 BER
+    // OBJECT IDENTIFIER. Returns false if it is malformed.
+    static bool EncodeOID(const std::string& dotted_oid, std::string* result);
+
+    // Appends a subidentifier to the value of an OBJECT IDENTIFIER.
+    static void AppendSubidentifier(uint64_t subidentifier, std::string* oid);
+
+    // Decodes a subidentifier of the value of an OBJECT IDENTIFIER, advancing
+    // "start" past it.
+    static uint64_t DecodeSubidentifier(const char** start, const char* end);
+
+    // Compares the values of two OBJECT IDENTIFIERs subidentifier by
+    // subidentifier, which their encodings can't be compared by. Returns a
+    // negative number, zero or a positive number, like memcmp().
+    static int CompareOIDs(const char* a, size_t a_size, const char* b,
+                           size_t b_size);
+
+    // Appends a variable binding of a name to NULL, as in requests, to the
+    // contents of a variable binding list.
+    static void AppendNullVarbind(const char* name, uint64_t name_size,
+                                  ArenaString* varbind_list);
+
+    // Appends a variable binding of a name to an encoded value to the
+    // contents of a variable binding list.
+    static void AppendVarbind(const char* name, uint64_t name_size,
+                              const char* value, uint64_t value_size,
+                              ArenaString* varbind_list);
+
+    // Builds PDU data out of an error status and index (or non-repeaters and
+    // max-repetitions) and the contents of a variable binding list.
+    static ArenaString BuildData(int64_t error_status, int64_t error_index,
+                                 const ArenaString& varbind_list);
+
+    // Builds the PDU data of the request that continues a walk: the previous
+    // request's, with variable bindings naming as many of the last variables
+    // of its response as it asked for. Returns false if the walk is over,
+    // because the response is an error, is short, or reached the end of the
+    // MIB view, or if the request has non-repeaters.
+    static bool ContinueWalk(const ArenaString& request_data,
+                             const Fields& request_fields,
+                             const ArenaString& response_data,
+                             ArenaString* result);
+
+    // Builds PDU data out of the fields preceding the variable binding list
+    // in "data" and the variable bindings at the given indices.
+    static ArenaString SelectVarbinds(const ArenaString& data,
+                                      const Fields& fields,
+                                      const ArenaVector<size_t>& indices);
+
+    // Encodes an ASN.1 BER INTEGER, including its type and length.
+    static ArenaString EncodeASN1Integer(int64_t input);
 
    private:
     bool initialized_;
     uint64_t length_;
-    std::string community_;
-    std::string community_index_;
+    ArenaString community_;
+    ArenaString community_index_;
     uint8_t pdu_type_;
     uint64_t pdu_length_;
     uint32_t request_id_;
 
     // All data after the request ID.
-    std::string data_;
+    ArenaString data_;
+
+    // Copies the parts of a parsed payload.
+    void Assign(const char* start, const char* end, const Offsets& offsets);
 
     // Decodes an ASN.1 BER-encoded short-form or long-form integer.
     static uint8_t DecodeASN1Int(const char* start, const char* end,
                                  uint64_t* result);
 
+    // Decodes an ASN.1 BER type and length, advancing "start" to the value.
+    static bool DecodeASN1TypeAndLength(const char** start, const char* end,
+                                        uint8_t* type, uint64_t* length);
+
+    // Decodes the value of an ASN.1 BER-encoded INTEGER.
+    static bool DecodeASN1Integer(const char* start, uint64_t length,
+                                  int64_t* result);
+
     // Encodes an integer into an ASN.1 BER-encoded short-form or long-form
     // integer.
-    static std::string EncodeASN1Int(uint64_t input);
+    static ArenaString EncodeASN1Int(uint64_t input);
   };
 
   class CacheKey {
    public:
-    CacheKey(const std::string& backend_host,
-             const std::string& community, const std::string& community_index,
-             uint8_t request_type, const std::string& request_data);
+    CacheKey(const ArenaString& backend_address,
+             const ArenaString& community, const ArenaString& community_index,
+             uint8_t request_type, const ArenaString& request_data);
+
+    // Copies a key into an arena, or onto the heap if it is null, as keys
+    // stored in the cache must be.
+    CacheKey(const CacheKey& other, Arena* arena);
 
     bool operator==(const CacheKey& other) const;
 
-    struct Hash {
-      size_t operator()(const CacheKey& cache_key) const;
-    };
+    const ArenaString& backend_address() const;
+    uint64_t hash() const;
+
+    // Appends the key to a cache handoff stream.
+    void Serialize(std::string* output) const;
+
+    // Parses a key from a cache handoff stream, advancing "start" past it.
+    static bool Deserialize(const char** start, const char* end,
+                            std::unique_ptr<CacheKey>* cache_key);
 
    private:
-    const std::string backend_host_;
-    const std::string community_;
-    const std::string community_index_;
+    // Hashes the fields of a key laid out back to back, with the lengths of
+    // all but the last in front of them, so that no two keys lay out alike.
+    static uint64_t HashFields(const ArenaString& backend_address,
+                               const ArenaString& community,
+                               const ArenaString& community_index,
+                               uint8_t request_type,
+                               const ArenaString& request_data);
+
+    const ArenaString backend_address_;
+    const ArenaString community_;
+    const ArenaString community_index_;
     const uint8_t request_type_;
-    const std::string request_data_;
+    const ArenaString request_data_;
+    const uint64_t hash_;
   };
 
   class CacheValue {
    public:
     CacheValue();
-    CacheValue(const std::string& response_data);
-    const std::string& response_data() const;
-    std::time_t time() const;
+    // Response data is always copied onto the heap.
+    CacheValue(const ArenaString& response_data, int64_t max_repetitions);
+    // Copies a value into an arena, or onto the heap if it is null.
+    CacheValue(const CacheValue& other, Arena* arena);
+    const ArenaString& response_data() const;
+    int64_t max_repetitions() const;
+
+   private:
+    ArenaString response_data_;
+
+    // For GetBulk responses, the max-repetitions of the request that produced
+    // them. Requests for fewer repetitions are served by truncation.
+    int64_t max_repetitions_;
+  };
+
+  // A cache partition's entries, laid out by what touches them. Lookups probe
+  // an open-addressed index of key hashes and slot numbers, expiry sweeps
+  // stream through per-slot arrays of insertion times and response sizes,
+  // and the keys and values themselves are only read to confirm a match or
+  // serve it. Freed slots are reused.
+  class Cache {
+   public:
+    typedef std::pair<const CacheKey, CacheValue> Entry;
+
+    static const uint32_t kNoSlot = UINT32_MAX;
+
+    Cache();
+
+    // Returns the slot holding a key, or kNoSlot.
+    uint32_t Find(const CacheKey& key) const;
+
+    // Looks up a batch of keys together, so that their probes wait on memory
+    // at the same time rather than one after another: the index positions of
+    // all of them are prefetched before any is probed, and the entries they
+    // match before any is compared. Sets the slot of each, or kNoSlot.
+    void Find(const CacheKey* const* keys, size_t num_keys,
+              uint32_t* slots) const;
+
+    // Sets the value of a key, fetched at "time" and fresh until
+    // "expiry_time", copying the key onto the heap if it's new.
+    void Insert(const CacheKey& key, const CacheValue& value, int64_t time,
+                int64_t expiry_time);
+
+    void Erase(uint32_t slot);
+
+    // Erases the entries that expired before "time". Returns how many there
+    // were.
+    size_t EraseExpiredBefore(int64_t time);
+
+    // The entry in a slot, or null if the slot is free, and when it was
+    // fetched and expires.
+    const Entry* entry(uint32_t slot) const;
+    int64_t time(uint32_t slot) const;
+    int64_t expiry_time(uint32_t slot) const;
+
+    // Slots are numbered below num_slots().
+    uint32_t num_slots() const;
+    size_t size() const;
+    size_t index_size() const;
+    // Total size of the cached responses.
+    size_t response_bytes() const;
+    // Counts keys by how many index positions are probed to find them, in
+    // buckets of 1, 2, 3-4, 5-8 and so on, and finds the longest probe.
+    void ProbeLengths(std::vector<size_t>* histogram,
+                      size_t* longest_probe) const;
+
+    // Bumped whenever an entry whose key hashes to it is replaced or erased,
+    // for near caches to check their copies against without taking the
+    // partition's mutex.
+    const std::atomic<uint32_t>* generation(uint64_t hash) const;
 
    private:
-    std::string response_data_;
-    std::time_t time_;
+    // Doubles the index and reinserts its slots by their stored hashes.
+    void GrowIndex();
+
+    // Index positions, each either empty (kNoSlot) or the hash of a key and
+    // its slot. A power of two in size, and never over half full.
+    std::vector<uint64_t> index_hashes_;
+    std::vector<uint32_t> index_slots_;
+
+    // Per-slot metadata, with times on the proxy's clock. Free slots expire
+    // at the latest possible time, so sweeps never erase them.
+    std::vector<int64_t> times_;
+    std::vector<int64_t> expiry_times_;
+    std::vector<uint32_t> sizes_;
+
+    std::vector<std::unique_ptr<Entry>> entries_;
+    std::vector<uint32_t> free_slots_;
+    size_t size_;
+
+    // Generations of stripes of keys, by hash.
+    static const size_t kNumGenerations = 4096;
+    std::unique_ptr<std::atomic<uint32_t>[]> generations_;
+  };
+
+  // A thread's copies of cache entries it served lately, in a small
+  // direct-mapped table in front of the shared cache, which hits on them
+  // without writing to memory any other thread touches. A copy is served only
+  // while the generation of its key in the shared cache is the one it was
+  // copied at, so never once the entry has been replaced or erased, and only
+  // until the entry expires or kNearCacheTTLMs after it was copied,
+  // whichever is sooner.
+  class NearCache {
+   public:
+    explicit NearCache(size_t size);
+
+    // Returns the copy of the entry for a key, or null.
+    const CacheValue* Find(const CacheKey& key, int64_t time) const;
+
+    // Copies an entry of a partition's cache. Call with the partition's cache
+    // mutex held.
+    void Insert(const CacheKey& key, const CacheValue& value,
+                const Cache& cache, int64_t expiry_time);
+
+   private:
+    // Each slot copies its entry into an arena of its own, which grows to
+    // the largest entry it has held and then stops allocating.
+    struct Slot {
+      Slot();
+      ~Slot();
+      void Clear();
+
+      std::unique_ptr<Arena> arena;
+      CacheKey* key;
+      CacheValue* value;
+      const std::atomic<uint32_t>* generation;
+      uint32_t copied_generation;
+      int64_t expiry_time;
+    };
+
+    std::unique_ptr<Slot[]> slots_;
+    const size_t size_;
   };
 
   const uint16_t port_;
   const std::string backend_community_;
-  const std::time_t backend_timeout_sec_;
+  const int64_t backend_timeout_ms_;
   const unsigned int num_backend_retries_;
-  const std::time_t cache_ttl_sec_;
+  const int64_t cache_ttl_ms_;
+  const std::string handoff_path_;
+  const double client_requests_per_sec_;
+  const unsigned int client_burst_;
+  const unsigned int max_client_misses_;
+  const bool reject_over_limit_;
+  const std::string xdp_interface_;
+  const uint32_t xdp_queue_;
+  const unsigned int num_workers_;
+  const unsigned int queue_size_;
+  const int64_t admission_window_ms_;
+  const std::vector<std::string> always_cache_oids_;
+  const unsigned int max_prefetch_depth_;
+  const std::vector<std::string> snapshot_table_oids_;
+  const unsigned int max_walks_per_backend_;
+  const unsigned int near_cache_size_;
+  const int64_t min_cache_ttl_ms_;
+  const int64_t max_cache_ttl_ms_;
+  const uint16_t trap_port_;
+  const std::string trap_community_;
+  const std::vector<std::string> trap_relays_;
   boost::asio::io_service io_service_;
-  std::unordered_map<CacheKey, CacheValue, CacheKey::Hash> cache_;
+
+  // Encoded OBJECT IDENTIFIERs of always_cache_oids_ and
+  // snapshot_table_oids_.
+  std::vector<std::string> always_cache_prefixes_;
+  std::vector<std::string> snapshot_tables_;
+
+  // Parsed trap_relays_.
+  std::vector<boost::asio::ip::address> trap_relay_addresses_;
+
+  // A notification a backend sends when some of its variables change, and
+  // the encoded OID prefixes of those variables, or none if it could be any
+  // of them. If "per_interface", only the variables of the interface the
+  // notification names by the instance of its first variable under the first
+  // prefix are.
+  struct TrapInvalidation {
+    std::string notification;
+    std::vector<std::string> prefixes;
+    bool per_interface;
+  };
+  std::vector<TrapInvalidation> trap_invalidations_;
+
+  // A request waiting for a worker, in a buffer from its node's pool, as
+  // parsed by the receiving thread.
+  struct Request {
+    char* buffer;
+    size_t size;
+    udp::endpoint remote_endpoint;
+    SNMPSequence::Offsets offsets;
+  };
+
+  // A thread's means of querying backends: an io_service and a socket that
+  // all of its queries share, a timer for their timeouts, and memory for the
+  // handlers of their asynchronous operations.
+  struct BackendClient {
+    BackendClient();
+
+    boost::asio::io_service io_service;
+    udp::socket socket;
+    boost::asio::steady_timer timer;
+    HandlerMemory handler_memory;
+
+    // Counts the queries sent on the socket, to give each its own request
+    // ID.
+    uint32_t num_queries;
+  };
+
+  // Changes seen in the values of a column of a backend's variables, the
+  // OIDs without their last subidentifiers, between refreshes of the entries
+  // holding them, and the time the refreshes were apart, both decayed by
+  // kVolatilityDecay at each refresh, so that they follow a column that goes
+  // from idle to busy.
+  struct ColumnVolatility {
+    double num_changes;
+    double observed_ms;
+    int64_t last_time;
+  };
+
+  // A cache partition, and the request queue and buffer pool of the workers
+  // serving it, all allocated by a thread running on one NUMA node. Requests
+  // are routed to nodes by backend, so each node's workers mostly touch their
+  // own partition.
+  struct Node {
+    explicit Node(unsigned int queue_size);
+
+    Cache cache;
+    std::mutex cache_mutex;
+
+    // Keys missed on since the admission window last started, which is
+    // when it was cleared. Guarded by cache_mutex.
+    BloomFilter doorkeeper;
+    int64_t doorkeeper_reset_time;
+
+    // Hashes of keys being prefetched, which requests for them wait on
+    // rather than query the backend as well. Guarded by cache_mutex.
+    std::unordered_set<uint64_t> keys_prefetching;
+    std::condition_variable prefetched_cv;
+
+    // Volatility of the columns in the partition's entries, by hash of
+    // backend address and column, when TTLs are learned. Guarded by
+    // cache_mutex.
+    std::unordered_map<uint64_t, ColumnVolatility> column_volatility;
+
+    MPMCQueue<Request> requests;
+    MPMCQueue<char*> free_buffers;
+    std::unique_ptr<char[]> buffers;
+
+    // Workers sleep on the condition variable when the queue is empty, and
+    // are only woken if they say they are sleeping.
+    std::atomic<unsigned int> num_sleeping_workers;
+    std::mutex requests_mutex;
+    std::condition_variable requests_cv;
+
+    // Set once workers should exit after serving the requests queued.
+    bool stopping;
+
+    // CPUs of the node that workers are pinned to.
+    std::vector<int> cpus;
+  };
+  std::vector<std::unique_ptr<Node>> nodes_;
+
+  // A worker's deque of requests taken from its node's queue. The worker
+  // pops from the back, and idle workers steal from the front, those on the
+  // same node before those on others, so that requests stuck behind a slow
+  // backend query are served by whoever is free.
+  struct Worker {
+    Node* node;
+    std::deque<Request> tasks;
+    std::mutex tasks_mutex;
+  };
+  std::vector<std::unique_ptr<Worker>> workers_;
+
+  // Requests in all workers' deques, which sleeping workers wake up to steal.
+  std::atomic<unsigned int> num_stealable_tasks_;
+
+  // Most allocations a miss has made, in builds that count them.
+  std::atomic<uint64_t> max_miss_allocations_;
+
+  // Milliseconds on the monotonic clock as of its last tick, which cache
+  // entries, snapshots and everything else that expires are timed by.
+  std::atomic<int64_t> clock_ms_;
+
+  // A resolved backend endpoint, and its address as cache keys spell it.
+  struct ResolvedBackend {
+    udp::endpoint endpoint;
+    ArenaString address;
+  };
+  typedef std::unordered_map<ArenaString, ResolvedBackend, StringHash>
+      BackendEndpoints;
+
+  // Resolved backends, by the host name clients address them by. A published
+  // map is never modified: resolving publishes a modified copy under mutex_
+  // and bumps the version, which threads check before looking in the copy
+  // they hold, so that finding a backend takes no lock.
+  std::shared_ptr<const BackendEndpoints> backend_endpoints_;
+  std::atomic<uint64_t> backend_endpoints_version_;
+
+  // Rate limiting state, in kNumClientSlots slots by a hash of the clients'
+  // IPv4 addresses: the steady clock time, in nanoseconds, at which a
+  // client's bucket would be full again.
+  std::unique_ptr<std::atomic<int64_t>[]> client_full_times_;
+
+  // Backend queries in flight for clients, in kNumClientSlots slots by a hash
+  // of their IPv4 addresses, if their number is limited. Clients that share
+  // a slot share its limits, like keys sharing doorkeeper bits.
+  std::unique_ptr<std::atomic<unsigned int>[]> client_misses_;
+
+  // A copy of a table on a backend, fetched all at once and never modified
+  // after, so that walks served from it see the table at one point in time.
+  struct TableSnapshot {
+    TableSnapshot();
+
+    // The key of the snapshot in snapshots_, and the time it was fetched at.
+    std::string key;
+    int64_t time;
+
+    // Names of the table's variables, in OID order, with their encoded
+    // values, or no value if it is in "numbers".
+    FrontCodedTable rows;
+    TypedColumns numbers;
+  };
+
+  // Rows of a table column after "start", up to and including "last", or to
+  // the end of the column if it is empty, fetched with a GetBulk chain of
+  // their own.
+  struct ColumnRange {
+    struct Row {
+      std::string name;
+      std::string value;
+    };
+
+    std::string start;
+    std::string last;
+    int64_t max_repetitions;
+    std::vector<Row> rows;
+    bool fetched;
+  };
+
+  // The latest snapshot of a table, which a refresh replaces in one go.
+  struct SnapshotSlot {
+    SnapshotSlot();
+
+    std::shared_ptr<const TableSnapshot> snapshot;
+    bool refreshing;
+  };
+
+  // By backend address, community and table.
+  std::unordered_map<ArenaString, SnapshotSlot, StringHash> snapshots_;
+  std::mutex snapshots_mutex_;
+
+  // GetBulk chains filling snapshots from each backend, by address, and the
+  // threads helping fetches walk them, which all fetches share a budget of.
+  std::unordered_map<std::string, unsigned int> backend_walks_;
+  unsigned int num_walk_threads_;
+  std::mutex backend_walks_mutex_;
+  std::condition_variable backend_walks_cv_;
+
+  // A client endpoint walking a table with GetNext or GetBulk requests. Each
+  // request that continues the walk has the walk prefetched some requests
+  // ahead, as many as it takes the backend to answer one in the time the
+  // client takes to send the next.
+  struct WalkSession {
+    WalkSession();
+
+    // The session's key, of the client endpoint walking.
+    uint64_t key;
+
+    uint8_t pdu_type;
+    std::string backend_host;
+
+    // The last request, with the backend community, and the PDU data of the
+    // one that would continue it.
+    std::string request;
+    std::string next_data;
+
+    std::chrono::steady_clock::time_point last_request_time;
+
+    // Moving averages of the time between the client's requests and of the
+    // time the backend takes to answer one.
+    std::chrono::steady_clock::duration request_gap;
+    std::chrono::steady_clock::duration fetch_time;
+
+    unsigned int prefetch_depth;
+    bool prefetching;
+
+    // The snapshot the walk is being served from, which it stays on until it
+    // leaves the table.
+    std::shared_ptr<const TableSnapshot> snapshot;
+  };
+
+  // Walk sessions, in kNumWalkSessionSlots slots by a hash of their keys, of
+  // which a new walk takes over any not being prefetched. Their strings have
+  // room reserved for any request, and cache hits only start walks with
+  // sessions from spare_walk_sessions_, which the sweep thread tops up, so
+  // that tracking a walk on a hit allocates nothing.
+  std::unique_ptr<std::unique_ptr<WalkSession>[]> walk_sessions_;
+  std::vector<std::unique_ptr<WalkSession>> spare_walk_sessions_;
+  std::mutex walk_sessions_mutex_;
+
+  // Walk sessions, by key, waiting for a prefetch thread.
+  MPMCQueue<uint64_t> prefetch_queue_;
+  std::mutex prefetch_mutex_;
+  std::condition_variable prefetch_cv_;
+
+  // Requests rejected for being over their client's limits, and dropped for
+  // lack of buffers, since the last report.
+  std::atomic<size_t> num_rejected_requests_;
+  std::atomic<size_t> num_dropped_requests_;
   std::mutex mutex_;
 
-  std::string GetResponse(const std::string& backend_host,
-                          const SNMPSequence& snmp_request);
+  // Written to by the handoff thread once another process has taken over the
+  // listening socket.
+  int handoff_pipe_[2];
+
+  // Counts a backend query against a client's limit on misses in flight for
+  // as long as it exists.
+  class ClientMiss {
+   public:
+    ClientMiss(SNMPProxy* snmp_proxy, uint32_t client_address);
+    ~ClientMiss();
+
+    // Whether the client was under its limit.
+    bool admitted() const;
+
+   private:
+    // The client's slot of client_misses_, if the miss is counted in it.
+    std::atomic<unsigned int>* misses_;
+    bool admitted_;
+  };
+
+  // Counts a GetBulk chain against its backend's limit for as long as it
+  // exists, waiting until the backend is under it.
+  class BackendWalk {
+   public:
+    BackendWalk(SNMPProxy* snmp_proxy, const std::string& backend_host);
+    ~BackendWalk();
+
+   private:
+    SNMPProxy* const snmp_proxy_;
+    const std::string& backend_host_;
+  };
+
+  // Unmarks a key as being prefetched, if it was marked, once the prefetch
+  // is cached and it goes out of scope.
+  class PrefetchedKey {
+   public:
+    PrefetchedKey(Node* partition, uint64_t key_hash);
+    ~PrefetchedKey();
+
+    // Call with the partition's cache mutex held.
+    void Mark();
+
+   private:
+    Node* const partition_;
+    const uint64_t key_hash_;
+    bool marked_;
+  };
+
+  // A request of a batch, parsed and keyed so that it can be looked up in the
+  // cache together with the rest, and how to serve it from a cache entry.
+  struct BatchedRequest {
+    SNMPSequence snmp_request;
+    SNMPSequence::Fields request_fields;
+    ArenaString backend_host;
+    ArenaVector<size_t> varbind_order;
+    CacheKey key;
+    Node* partition;
+    bool walk;
+    bool (*answers)(const CacheValue&, const SNMPSequence::Fields&);
+    ArenaString (*serve)(const CacheValue&, const ArenaString&,
+                         const SNMPSequence&, const SNMPSequence::Fields&,
+                         const ArenaVector<size_t>&);
+
+    // Position of the request in its batch.
+    size_t index;
+    bool hit;
+    ArenaString response;
+  };
+
+  // Creates a node for each NUMA node that workers will run on, or a single
+  // one if requests are served by the receiving thread.
+  void SetUpNodes();
+
+  // Returns the node whose cache partition holds a backend's entries.
+  size_t CachePartitionIndex(const ArenaString& backend_address);
+  Node* CachePartition(const ArenaString& backend_address);
+
+  // Adds a datagram from a client to the batch for the node of its backend.
+  // Returns false if it should be served by the receiving thread instead.
+  bool DispatchRequest(const char* start, const char* end,
+                       const udp::endpoint& remote_endpoint,
+                       std::vector<std::vector<Request>>* batches);
+
+  // Hands batches of requests to their nodes' workers.
+  void EnqueueRequests(std::vector<std::vector<Request>>* batches);
+
+  // Serves requests queued for a worker's node, pinned to one of its CPUs,
+  // and steals requests from other workers when there are none.
+  void Work(Worker* worker, int cpu, udp::socket* socket);
+
+  // Looks up a batch of requests dequeued for a node in the cache together,
+  // and serves those that hit. Moves the rest to the front of the batch, in
+  // order, for the usual path, and returns how many there are.
+  size_t ServeCacheHits(Request* requests, size_t num_requests, Node* node,
+                        Arena* arena, udp::socket* socket);
+
+  // Moves requests into a worker's deque, and wakes a sleeping worker to
+  // steal them, preferably one on the same node.
+  void PushTasks(Worker* worker, const Request* requests, size_t count);
+
+  // Pops the newest request from a worker's deque.
+  bool PopTask(Worker* worker, Request* request);
 
-  void TimeoutRead(boost::asio::ip::udp::socket& socket,
-                   std::condition_variable* cv);
-                            
-  void Read(size_t bytes_transferred, size_t* response_size,
-            std::condition_variable* cv);
+  // Takes the oldest request from the deque of a random other worker on the
+  // thief's node, or on another node if none there has any, and returns that
+  // worker's node, whose pool the request's buffer belongs to.
+  bool StealTask(Worker* thief, std::minstd_rand* random, Request* request,
+                 Node** node);
+
+  // Has workers finish the requests queued for them and exit.
+  void StopWorkers(std::vector<std::thread>* worker_threads);
+
+  // Serves a parsed datagram from a client and returns the response to send
+  // back, or an empty string if it should be dropped.
+  ArenaString HandleRequest(SNMPSequence* snmp_sequence,
+                            const udp::endpoint& remote_endpoint,
+                            BackendClient* backend_client, bool* cache_hit);
+
+  // In builds that count allocations, checks those a thread made serving a
+  // request. Once the thread has warmed up, a cache hit that allocates is
+  // fatal, and a miss that allocates more than any before is reported.
+  void CheckAllocations(bool cache_hit, uint64_t num_allocations);
+
+  // Serves requests pending on the AF_XDP socket. Cache hits are answered
+  // through it, and everything else through the listening socket.
+  void ServeXDPRequests(udp::socket* socket, XDPSocket* xdp_socket,
+                        Arena* arena, BackendClient* backend_client);
+
+  // Compile-time knowledge of how requests of each PDU type lay out their
+  // fields and share cache entries, which the request path is specialized
+  // on.
+  struct GetPDU;
+  struct GetNextPDU;
+  struct GetBulkPDU;
+  struct OpaquePDU;
+
+  // Rewrites a request's community to the one to query the backend with.
+  void UseBackendCommunity(SNMPSequence* snmp_request) const;
+
+  // Admits and logs a request of a PDU type, and serves it.
+  template <typename PDU>
+  ArenaString ServeRequest(SNMPSequence* snmp_request,
+                           const udp::endpoint& remote_endpoint,
+                           BackendClient* backend_client, bool* cache_hit);
+
+  // The calling thread's near cache, or null if threads keep none.
+  NearCache* ThreadNearCache();
+
+  // Serves a request from a cache entry, or a copy of one, that answers it.
+  template <typename PDU>
+  static ArenaString ServeCacheValue(const CacheValue& cache_value,
+                                     const ArenaString& backend_host,
+                                     const SNMPSequence& snmp_request,
+                                     const SNMPSequence::Fields& request_fields,
+                                     const ArenaVector<size_t>& varbind_order);
+
+  // Parses and keys a request of a PDU type for ServeCacheHits(), and adds
+  // it to the batch. Requests that can't be keyed, or that may be served
+  // from a snapshot, are left out.
+  template <typename PDU>
+  void KeyBatchedRequest(const SNMPSequence& snmp_sequence, size_t index,
+                         ArenaVector<BatchedRequest>* batch);
+
+  // Works out the form of a request that a backend is queried with, the
+  // order to put the variables of its response back into, and the key it is
+  // cached under.
+  template <typename PDU>
+  CacheKey KeyRequest(const SNMPSequence& snmp_request,
+                      const SNMPSequence::Fields& request_fields,
+                      const ArenaString& backend_address,
+                      SNMPSequence* canonical_request,
+                      ArenaVector<size_t>* varbind_order);
+
+  template <typename PDU>
+  ArenaString GetResponse(const ArenaString& backend_host,
+                          uint32_t client_address,
+                          const SNMPSequence& snmp_request,
+                          const SNMPSequence::Fields& request_fields,
+                          BackendClient* backend_client, bool* cache_hit,
+                          bool prefetch);
+
+  // Serves a GetNext or GetBulk request for variables of a snapshot table
+  // from a snapshot of it: the one the client's walk is on, or a fresh one,
+  // fetched if need be, which makes it a miss. Returns false if there is
+  // none, or if the response would run past the end of the table.
+  bool ServeFromSnapshot(const udp::endpoint& remote_endpoint,
+                         const ArenaString& backend_host,
+                         uint32_t client_address,
+                         const SNMPSequence& snmp_request,
+                         const SNMPSequence::Fields& request_fields,
+                         int64_t repetitions, BackendClient* backend_client,
+                         ArenaString* response,
+                         std::shared_ptr<const TableSnapshot>* snapshot,
+                         bool* cache_hit);
+
+  // Returns a fresh snapshot of a table, fetching it unless another thread
+  // already is, in which case the stale one is returned. Returns null if
+  // there is none. Sets "fetched" if this call fetched it.
+  std::shared_ptr<const TableSnapshot> GetSnapshot(
+      const ArenaString& snapshot_key, size_t table_index,
+      const ArenaString& backend_host, uint32_t client_address,
+      const udp::endpoint& backend_endpoint, const SNMPSequence& snmp_request,
+      BackendClient* backend_client, bool* fetched);
+
+  // Fetches a table by walking its first column, then ranges of the others
+  // split at the indices of its rows, several at once, with requests built
+  // from "snmp_request". Returns null if any of them fails.
+  std::shared_ptr<const TableSnapshot> FetchSnapshot(
+      const ArenaString& snapshot_key, size_t table_index,
+      const ArenaString& backend_host, const udp::endpoint& backend_endpoint,
+      const SNMPSequence& snmp_request, BackendClient* backend_client);
+
+  // Walks a range of a column with GetBulk requests built from "query".
+  bool FetchRange(BackendClient* backend_client,
+                  const udp::endpoint& backend_endpoint,
+                  const std::string& column, SNMPSequence* query,
+                  ColumnRange* range);
+
+  // Queries a backend for what follows a name with a GetNext or GetBulk
+  // request built from "query", retrying as configured. Returns the PDU data
+  // of the response, or an empty string.
+  ArenaString QueryNext(BackendClient* backend_client,
+                        const udp::endpoint& backend_endpoint,
+                        SNMPSequence* query, uint8_t pdu_type,
+                        int64_t max_repetitions, const std::string& name);
+
+  // Forgets snapshots that went stale, unless walks are still on them.
+  void EvictStaleSnapshots();
+
+  static uint64_t WalkSessionKey(const udp::endpoint& remote_endpoint);
+
+  // Whether a request continues a client's walk.
+  static bool ContinuesWalk(const WalkSession& session,
+                            const ArenaString& backend_host,
+                            const SNMPSequence& snmp_request);
+
+  // Returns the slot of walk_sessions_ a session key has.
+  static size_t WalkSessionSlot(uint64_t session_key);
+
+  // Notes a GetNext or GetBulk request, its response and the snapshot it was
+  // served from, if any, in its client's walk session, and has the walk
+  // prefetched if the request continues it.
+  void TrackWalk(const udp::endpoint& remote_endpoint,
+                 const ArenaString& backend_host,
+                 const SNMPSequence& snmp_request,
+                 const SNMPSequence::Fields& request_fields,
+                 const ArenaString& response,
+                 const std::shared_ptr<const TableSnapshot>& snapshot,
+                 bool cache_hit);
+
+  // Run by prefetch threads.
+  void PrefetchWalks();
+
+  // Fetches up to "depth" requests of a walk into the cache, starting with
+  // "snmp_request". Returns the average time the backend took to answer
+  // those that missed, or zero if none did.
+  template <typename PDU>
+  std::chrono::steady_clock::duration PrefetchWalk(
+      const ArenaString& backend_host, uint32_t client_address,
+      unsigned int depth, SNMPSequence* snmp_request,
+      BackendClient* backend_client);
+
+  // Builds a resourceUnavailable response to a request.
+  static ArenaString ErrorResponse(const ArenaString& backend_host,
+                                   const SNMPSequence& snmp_request);
+
+  // Takes a token from a client's bucket. Returns false if it has none left.
+  bool AdmitRequest(uint32_t client_address);
+
+  // Whether a response may be cached, which it may be the second time its
+  // key misses in an admission window. Call with the partition's cache mutex
+  // held.
+  bool AdmitToCache(Node* partition, const CacheKey& key);
+
+  // Returns how long a response fetched now stays fresh: the cache TTL or,
+  // when TTLs are learned, the shortest of those of the columns of its
+  // variables. Learns first from the response it refreshes, fetched at
+  // "previous_time", if there is one. Call with the partition's cache mutex
+  // held.
+  int64_t LearnCacheTTL(Node* partition, const ArenaString& backend_address,
+                        const ArenaString& response_data,
+                        const ArenaString* previous_data,
+                        int64_t previous_time);
+
+  // Whether a request asks only for variables under always_cache_oids_,
+  // whose responses are cached the first time.
+  bool AlwaysCache(const ArenaString& request_data,
+                   const SNMPSequence::Fields& request_fields) const;
+
+  // Reports the requests rejected and dropped since the last report.
+  void ReportRejectedRequests();
+
+  // Forgets walk sessions idle for longer than the cache TTL, keeping them
+  // as spares, and tops the spares up to kNumSpareWalkSessions.
+  void EvictIdleWalkSessions();
+
+  // Finds a backend host in the calling thread's copy of backend_endpoints_,
+  // along with its address as cache keys spell it.
+  bool FindBackend(const ArenaString& backend_host, udp::endpoint* endpoint,
+                   ArenaString* backend_address);
+
+  // Finds a backend host, or resolves it if it has never been resolved.
+  bool ResolveBackend(const ArenaString& backend_host,
+                      udp::endpoint* endpoint, ArenaString* backend_address);
+
+  // Resolves a backend host with the system resolver.
+  bool QueryResolver(const ArenaString& backend_host,
+                     ResolvedBackend* resolved_backend);
+
+  // Resolves every backend again, once per sweep, and forgets those that no
+  // longer resolve so that their next request reports it.
+  void RefreshBackends();
+
+  // Returns the effective number of GetBulk non-repeaters in a request.
+  static size_t NonRepeaters(const SNMPSequence::Fields& request_fields);
+
+  // Returns the client positions of a request's variable bindings in
+  // canonical order.
+  static ArenaVector<size_t> CanonicalVarbindOrder(
+      const ArenaString& request_data,
+      const SNMPSequence::Fields& request_fields, size_t non_repeaters);
+
+  // Puts the variable bindings of response data to a canonical-order request
+  // back into the order of the client's request.
+  static ArenaString RestoreVarbindOrder(
+      const ArenaString& response_data,
+      const SNMPSequence::Fields& request_fields, bool bulk_request,
+      const ArenaVector<size_t>& varbind_order);
+
+  // Truncates cached GetBulk response data to what a request with the given
+  // fields would have gotten.
+  static ArenaString TruncateBulkResponse(
+      const ArenaString& response_data,
+      const SNMPSequence::Fields& request_fields);
+
+  // Sends a request to a backend and waits up to the backend timeout for its
+  // response, skipping late responses to earlier requests. Returns the size
+  // of the response, or 0 if none came.
+  size_t QueryBackend(BackendClient* backend_client,
+                      const udp::endpoint& backend_endpoint,
+                      const SNMPSequence& snmp_request,
+                      boost::array<char, 65536>* response);
+
+  // The time on the proxy's clock, which is a load rather than a call into
+  // the kernel, and which the wall clock being stepped doesn't move.
+  int64_t NowMs() const;
+
+  // Advances the proxy's clock every kClockTickMs.
+  void TickClock();
+
+  // Receives SNMPv2c traps and informs carrying the trap community,
+  // acknowledging the informs, and invalidates what known notifications
+  // among them say has changed on the backend that sent them, or that a
+  // relay forwarded them for.
+  void ListenForTraps(udp::socket* socket);
+
+  // Erases the cache entries and table snapshots of a backend holding the
+  // variables a notification invalidates. A non-empty "instance" limits
+  // them to the variables named by a prefix, one more subidentifier, then
+  // the instance. Returns how many cache entries there were.
+  size_t InvalidateBackend(const ArenaString& backend_address,
+                           const TrapInvalidation& invalidation,
+                           const std::string& instance);
 
   void EvictStaleCacheEntries();
+
+  // Logs how full a cache partition's index is and how far lookups probe,
+  // with a histogram of probe lengths.
+  void LogCacheIndex(size_t partition_index, const Cache& cache);
+
+  // Connects to a running proxy's handoff socket and takes over its listening
+  // socket and cache. Returns false if there is no proxy to take over from.
+  bool TakeOverSocket(udp::socket* socket);
+
+  // Waits for a new proxy to connect to the handoff socket and passes it the
+  // listening socket and a snapshot of the cache.
+  void HandOffSocket(boost::asio::local::stream_protocol::acceptor* acceptor,
+                     udp::socket* socket);
+
+  // Encodes the cache into the handoff stream format.
+  std::string SerializeCache();
+
+  // Loads cache entries from a handoff stream.
+  bool DeserializeCache(const std::string& input);
 };
@@ -22,6 +22,11 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
 #include <boost/program_options.hpp>
 
 #include "snmp_proxy.h"
@@ -29,9 +34,28 @@
 int main(int argc, char* argv[]) {
   uint16_t port;
   std::string backend_community;
-  std::time_t backend_timeout_sec;
+  double backend_timeout_sec;
   unsigned int num_backend_retries;
-  std::time_t cache_ttl_sec;
+  double cache_ttl_sec;
+  std::string handoff_path;
+  double client_requests_per_sec;
+  unsigned int client_burst;
+  unsigned int max_client_misses;
+  std::string xdp_interface;
+  uint32_t xdp_queue;
+  unsigned int num_workers;
+  unsigned int queue_size;
+  double admission_window_sec;
+  std::vector<std::string> always_cache_oids;
+  unsigned int max_prefetch_depth;
+  std::vector<std::string> snapshot_tables;
+  unsigned int max_walks_per_backend;
+  unsigned int near_cache_size;
+  double min_cache_ttl_sec;
+  double max_cache_ttl_sec;
+  uint16_t trap_port;
+  std::string trap_community;
+  std::vector<std::string> trap_relays;
   boost::program_options::options_description description("Available options");
   description.add_options()
       ("help", "print available options")
@@ -42,17 +66,116 @@ int main(int argc, char* argv[]) {
        boost::program_options::value<std::string>(&backend_community),
        "set community to query on backend devices")
       ("backend_timeout_sec",
-       boost::program_options::value<std::time_t>(&backend_timeout_sec)->
+       boost::program_options::value<double>(&backend_timeout_sec)->
            default_value(2),
-       "set timeout, in seconds, for querying backends")
+       "set timeout, in seconds down to milliseconds, for querying backends")
       ("num_backend_retries",
        boost::program_options::value<unsigned int>(&num_backend_retries)->
            default_value(2),
        "set number of retries for querying backends")
       ("cache_ttl_sec",
-       boost::program_options::value<std::time_t>(&cache_ttl_sec)->
+       boost::program_options::value<double>(&cache_ttl_sec)->
            default_value(300),
-       "set time-to-live, in seconds, for cache entries");
+       "set time-to-live, in seconds down to milliseconds, for cache entries")
+      ("handoff_path",
+       boost::program_options::value<std::string>(&handoff_path),
+       "set UNIX domain socket path over which to take over the listening "
+       "socket and cache from a running proxy, and to hand them off to the "
+       "next one")
+      ("client_requests_per_sec",
+       boost::program_options::value<double>(&client_requests_per_sec)->
+           default_value(0),
+       "set rate, in requests per second, at which to admit requests from each "
+       "client address (0 for no limit)")
+      ("client_burst",
+       boost::program_options::value<unsigned int>(&client_burst)->
+           default_value(100),
+       "set number of requests each client address may send in a burst above "
+       "its rate")
+      ("max_client_misses",
+       boost::program_options::value<unsigned int>(&max_client_misses)->
+           default_value(0),
+       "set number of backend queries each client address may have in flight "
+       "(0 for no limit)")
+      ("reject_over_limit",
+       "answer requests over a client's limits with resourceUnavailable "
+       "instead of dropping them")
+      ("xdp_interface",
+       boost::program_options::value<std::string>(&xdp_interface),
+       "set network interface on which to serve cache hits over AF_XDP")
+      ("xdp_queue",
+       boost::program_options::value<uint32_t>(&xdp_queue)->default_value(0),
+       "set receive queue of the AF_XDP interface to serve")
+      ("num_workers",
+       boost::program_options::value<unsigned int>(&num_workers)->
+           default_value(0),
+       "set number of worker threads, spread across NUMA nodes and pinned to "
+       "CPUs (0 to serve requests on the receiving thread)")
+      ("queue_size",
+       boost::program_options::value<unsigned int>(&queue_size)->
+           default_value(1024),
+       "set number of requests that may be queued for each NUMA node's "
+       "workers")
+      ("admission_window_sec",
+       boost::program_options::value<double>(&admission_window_sec)->
+           default_value(0),
+       "set window, in seconds down to milliseconds, within which a response "
+       "must be missed on twice before it is cached (0 to cache every "
+       "response)")
+      ("always_cache_oid",
+       boost::program_options::value<std::vector<std::string>>(
+           &always_cache_oids),
+       "set OID prefix under which responses are cached the first time, "
+       "regardless of the admission window (may be repeated)")
+      ("max_prefetch_depth",
+       boost::program_options::value<unsigned int>(&max_prefetch_depth)->
+           default_value(0),
+       "set number of requests ahead of a client walking a table with "
+       "GetNext or GetBulk to prefetch, at most (0 to not prefetch)")
+      ("snapshot_table",
+       boost::program_options::value<std::vector<std::string>>(
+           &snapshot_tables),
+       "set OID of a table to fetch whole, all columns at once, and serve "
+       "walks of from that snapshot until it is older than the cache TTL (may "
+       "be repeated)")
+      ("max_walks_per_backend",
+       boost::program_options::value<unsigned int>(&max_walks_per_backend)->
+           default_value(8),
+       "set number of GetBulk chains that may fetch snapshot tables from a "
+       "backend at once, at most")
+      ("near_cache_size",
+       boost::program_options::value<unsigned int>(&near_cache_size)->
+           default_value(0),
+       "set number of cache entries each thread keeps copies of, to serve hot "
+       "keys without locking the shared cache (0 to keep none)")
+      ("min_cache_ttl_sec",
+       boost::program_options::value<double>(&min_cache_ttl_sec)->
+           default_value(0),
+       "set shortest time-to-live, in seconds down to milliseconds, that "
+       "cache entries are given when their columns' values are learned to "
+       "change often (0 for the cache TTL)")
+      ("max_cache_ttl_sec",
+       boost::program_options::value<double>(&max_cache_ttl_sec)->
+           default_value(0),
+       "set longest time-to-live, in seconds down to milliseconds, that cache "
+       "entries are given when their columns' values are learned to change "
+       "rarely (0 for the cache TTL; TTLs are learned per column and backend "
+       "if it differs from the shortest)")
+      ("trap_port",
+       boost::program_options::value<uint16_t>(&trap_port)->default_value(0),
+       "set port on which to receive SNMPv2c traps and informs from backends, "
+       "whose linkUp, linkDown, coldStart, warmStart and configuration change "
+       "notifications invalidate what is cached of them (0 to not listen; "
+       "usually 162)")
+      ("trap_community",
+       boost::program_options::value<std::string>(&trap_community),
+       "set community that traps and informs must carry to be acted on "
+       "(required with --trap_port)")
+      ("trap_relay",
+       boost::program_options::value<std::vector<std::string>>(&trap_relays),
+       "set address of a relay whose notifications invalidate the backend "
+       "named by their snmpTrapAddress.0, rather than the relay itself (may "
+       "be repeated)");
   boost::program_options::variables_map variables_map;
   boost::program_options::store(
       boost::program_options::parse_command_line(argc, argv, description),
@@ -64,8 +187,20 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  SNMPProxy snmp_proxy(port, backend_community, backend_timeout_sec,
-                       num_backend_retries, cache_ttl_sec);
+  SNMPProxy snmp_proxy(port, backend_community,
+                       std::llround(backend_timeout_sec * 1000),
+                       num_backend_retries, std::llround(cache_ttl_sec * 1000),
+                       handoff_path,
+                       client_requests_per_sec, client_burst, max_client_misses,
+                       variables_map.count("reject_over_limit") > 0,
+                       xdp_interface, xdp_queue, num_workers, queue_size,
+                       std::llround(admission_window_sec * 1000),
+                       always_cache_oids,
+                       max_prefetch_depth, snapshot_tables,
+                       max_walks_per_backend, near_cache_size,
+                       std::llround(min_cache_ttl_sec * 1000),
+                       std::llround(max_cache_ttl_sec * 1000), trap_port,
+                       trap_community, trap_relays);
   if (!snmp_proxy.Start()) {
     return 1;
   }
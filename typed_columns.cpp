@@ -0,0 +1,157 @@
+/*
+ * Copyright 2016 Boris Kochergin. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "typed_columns.h"
+
+// ASN.1 types stored (RFC 2578).
+static const uint8_t kIntegerType = 0x02;
+static const uint8_t kCounter32Type = 0x41;
+static const uint8_t kGauge32Type = 0x42;
+static const uint8_t kTimeTicksType = 0x43;
+static const uint8_t kCounter64Type = 0x46;
+
+TypedColumns::TypedColumns() {}
+
+bool TypedColumns::Append(size_t row, const char* value, size_t value_size) {
+  uint8_t type;
+  uint64_t number;
+  char encoded[kMaxValueSize];
+  if (!Decode(value, value_size, &type, &number) ||
+      Encode(type, number, encoded) != value_size ||
+      memcmp(encoded, value, value_size) != 0) {
+    return false;
+  }
+  const bool wide = IsSigned(type) ?
+      int64_t(number) != int64_t(int32_t(number)) : number > UINT32_MAX;
+  if (runs_.empty() || runs_.back().type != type ||
+      runs_.back().first_row + runs_.back().num_rows != row ||
+      (wide && !runs_.back().wide)) {
+    runs_.push_back({row, 0, type, wide, wide ? wide_.size() : narrow_.size()});
+  }
+  Run& run = runs_.back();
+  if (run.wide) {
+    wide_.push_back(number);
+  } else {
+    narrow_.push_back(uint32_t(number));
+  }
+  ++run.num_rows;
+  return true;
+}
+
+void TypedColumns::ShrinkToFit() {
+  runs_.shrink_to_fit();
+  narrow_.shrink_to_fit();
+  wide_.shrink_to_fit();
+}
+
+size_t TypedColumns::memory_size() const {
+  return runs_.capacity() * sizeof(Run) +
+         narrow_.capacity() * sizeof(uint32_t) +
+         wide_.capacity() * sizeof(uint64_t);
+}
+
+bool TypedColumns::Decode(const char* value, size_t value_size,
+                          uint8_t* type, uint64_t* number) {
+  if (value_size < 3) {
+    return false;
+  }
+  *type = value[0];
+  const size_t length = uint8_t(value[1]);
+  if ((*type != kIntegerType && *type != kCounter32Type &&
+       *type != kGauge32Type && *type != kTimeTicksType &&
+       *type != kCounter64Type) ||
+      length != value_size - 2 || length > 9 ||
+      (length == 9 && value[2] != 0)) {
+    return false;
+  }
+
+  // Unsigned types that come out negative are left as they were sent.
+  const bool negative = value[2] & 0x80;
+  if (negative && !IsSigned(*type)) {
+    return false;
+  }
+  *number = negative ? ~uint64_t(0) : 0;
+  for (size_t i = 2; i < value_size; ++i) {
+    *number = (*number << 8) | uint8_t(value[i]);
+  }
+  return true;
+}
+
+size_t TypedColumns::Encode(uint8_t type, uint64_t number, char* value) {
+  // Big-endian, without leading bytes that only repeat the sign bit of the
+  // next. Unsigned types are never negative.
+  char content[9];
+  size_t size = 0;
+  const bool negative = IsSigned(type) && int64_t(number) < 0;
+  do {
+    content[sizeof(content) - 1 - size] = char(number & 0xff);
+    ++size;
+    number = negative ? ~(~number >> 8) : number >> 8;
+  } while (negative ? number != ~uint64_t(0) : number != 0);
+  if (bool(content[sizeof(content) - size] & 0x80) != negative) {
+    content[sizeof(content) - 1 - size] = negative ? char(0xff) : 0;
+    ++size;
+  }
+  value[0] = type;
+  value[1] = char(size);
+  memcpy(value + 2, content + sizeof(content) - size, size);
+  return size + 2;
+}
+
+bool TypedColumns::IsSigned(uint8_t type) {
+  return type == kIntegerType;
+}
+
+TypedColumns::Cursor::Cursor(const TypedColumns* columns) :
+    columns_(columns), run_(0) {}
+
+size_t TypedColumns::Cursor::Encode(size_t row, char* value) {
+  const std::vector<Run>& runs = columns_->runs_;
+  if (run_ >= runs.size() || row < runs[run_].first_row ||
+      row >= runs[run_].first_row + runs[run_].num_rows) {
+    // Find the last run starting at or before the row.
+    run_ = std::upper_bound(runs.begin(), runs.end(), row,
+                            [](size_t row, const Run& run) {
+                              return row < run.first_row;
+                            }) - runs.begin();
+    if (run_ == 0) {
+      return 0;
+    }
+    --run_;
+    if (row >= runs[run_].first_row + runs[run_].num_rows) {
+      return 0;
+    }
+  }
+  const Run& run = runs[run_];
+  const size_t index = run.offset + row - run.first_row;
+  uint64_t number = run.wide ? columns_->wide_[index] :
+                               columns_->narrow_[index];
+  if (!run.wide && IsSigned(run.type)) {
+    number = uint64_t(int64_t(int32_t(uint32_t(number))));
+  }
+  return TypedColumns::Encode(run.type, number, value);
+}
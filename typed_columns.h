@@ -0,0 +1,87 @@
+/*
+ * Copyright 2016 Boris Kochergin. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Integer values (INTEGER, Counter32, Gauge32, TimeTicks and Counter64) of
+// rows of a table, stored fixed-width in runs of consecutive rows of one type
+// rather than BER-encoded, and encoded again as they are read. Runs are 32
+// bits wide for as long as their values fit. Once built, it may be read from
+// several threads.
+class TypedColumns {
+ public:
+  // The most bytes a value takes up encoded.
+  static const size_t kMaxValueSize = 11;
+
+  TypedColumns();
+
+  // Stores the BER-encoded value of a row, which must follow the last one
+  // stored, if it is an integer that encodes back to the same bytes.
+  // Returns false if it isn't, for the value to be stored as it is.
+  bool Append(size_t row, const char* value, size_t value_size);
+
+  // Frees space reserved for values that will not be added.
+  void ShrinkToFit();
+
+  // Bytes the values take up.
+  size_t memory_size() const;
+
+  // Reads the values of rows, fastest in increasing order.
+  class Cursor {
+   public:
+    explicit Cursor(const TypedColumns* columns);
+
+    // Encodes the value of a row into "value", which holds at least
+    // kMaxValueSize bytes, and returns its size, or 0 if it isn't stored.
+    size_t Encode(size_t row, char* value);
+
+   private:
+    const TypedColumns* columns_;
+    size_t run_;
+  };
+
+ private:
+  struct Run {
+    size_t first_row;
+    size_t num_rows;
+    uint8_t type;
+    bool wide;
+
+    // Of the first value in narrow_ or wide_.
+    size_t offset;
+  };
+
+  // Decodes a value, returning false if it isn't an integer of a type
+  // stored. INTEGERs are returned sign-extended.
+  static bool Decode(const char* value, size_t value_size, uint8_t* type,
+                     uint64_t* number);
+  static size_t Encode(uint8_t type, uint64_t number, char* value);
+  static bool IsSigned(uint8_t type);
+
+  std::vector<Run> runs_;
+  std::vector<uint32_t> narrow_;
+  std::vector<uint64_t> wide_;
+};
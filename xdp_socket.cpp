@@ -0,0 +1,442 @@
+/*
+ * Copyright 2016 Boris Kochergin. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+#include <iostream>
+
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "xdp_socket.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+static const uint32_t kNumFrames = 4096;
+static const uint32_t kFrameSize = 2048;
+
+// Half of the frames are for receiving into and half are for transmitting
+// from, and each ring can hold all of the frames in its half.
+static const uint32_t kRingSize = kNumFrames / 2;
+
+static const size_t kEthernetHeaderSize = 14;
+static const size_t kIPv4HeaderSize = 20;
+static const size_t kUDPHeaderSize = 8;
+static const uint16_t kIPv4EtherType = 0x0800;
+static const uint8_t kUDPProtocol = 17;
+
+static bpf_insn Instruction(uint8_t code, uint8_t dst_reg, uint8_t src_reg,
+                            int16_t off, int32_t imm) {
+  bpf_insn instruction;
+  instruction.code = code;
+  instruction.dst_reg = dst_reg;
+  instruction.src_reg = src_reg;
+  instruction.off = off;
+  instruction.imm = imm;
+  return instruction;
+}
+
+static long BPF(int command, bpf_attr* attr) {
+  return syscall(__NR_bpf, command, attr, sizeof(*attr));
+}
+
+static uint16_t IPv4Checksum(const unsigned char* header) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i < kIPv4HeaderSize; i += 2) {
+    sum += (header[i] << 8) | header[i + 1];
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return ~sum;
+}
+
+XDPSocket::XDPSocket(const std::string& interface, uint32_t queue,
+                     uint16_t port) :
+    interface_(interface), queue_(queue), port_(port), fd_(-1), map_fd_(-1),
+    program_fd_(-1), link_fd_(-1), umem_(nullptr), fill_ring_(),
+    completion_ring_(), rx_ring_(), tx_ring_() {}
+
+XDPSocket::~XDPSocket() {
+  // Closing the link detaches the program from the interface.
+  for (int fd : {link_fd_, program_fd_, map_fd_}) {
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+  for (Ring* ring : {&fill_ring_, &completion_ring_, &rx_ring_, &tx_ring_}) {
+    if (ring->map != nullptr) {
+      munmap(ring->map, ring->map_size);
+    }
+  }
+  if (fd_ != -1) {
+    close(fd_);
+  }
+  if (umem_ != nullptr) {
+    munmap(umem_, size_t(kNumFrames) * kFrameSize);
+  }
+}
+
+bool XDPSocket::Open() {
+  const unsigned int ifindex = if_nametoindex(interface_.c_str());
+  if (ifindex == 0) {
+    std::cerr << "Could not find interface " << interface_ << "."
+              << std::endl;
+    return false;
+  }
+  fd_ = socket(AF_XDP, SOCK_RAW, 0);
+  if (fd_ == -1) {
+    std::cerr << "Could not create AF_XDP socket: " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+
+  // Register the memory that frames are received into and sent from.
+  void* umem = mmap(nullptr, size_t(kNumFrames) * kFrameSize,
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (umem == MAP_FAILED) {
+    std::cerr << "Could not allocate AF_XDP frames: " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+  umem_ = (char*)umem;
+  xdp_umem_reg umem_reg = {};
+  umem_reg.addr = (uintptr_t)umem_;
+  umem_reg.len = size_t(kNumFrames) * kFrameSize;
+  umem_reg.chunk_size = kFrameSize;
+  const uint32_t ring_size = kRingSize;
+  if (setsockopt(fd_, SOL_XDP, XDP_UMEM_REG, &umem_reg,
+                 sizeof(umem_reg)) != 0 ||
+      setsockopt(fd_, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size,
+                 sizeof(ring_size)) != 0 ||
+      setsockopt(fd_, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size,
+                 sizeof(ring_size)) != 0 ||
+      setsockopt(fd_, SOL_XDP, XDP_RX_RING, &ring_size,
+                 sizeof(ring_size)) != 0 ||
+      setsockopt(fd_, SOL_XDP, XDP_TX_RING, &ring_size,
+                 sizeof(ring_size)) != 0) {
+    std::cerr << "Could not set up AF_XDP rings: " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+  xdp_mmap_offsets offsets;
+  socklen_t offsets_size = sizeof(offsets);
+  if (getsockopt(fd_, SOL_XDP, XDP_MMAP_OFFSETS, &offsets,
+                 &offsets_size) != 0 ||
+      !MapRing(XDP_UMEM_PGOFF_FILL_RING, offsets.fr, sizeof(uint64_t),
+               &fill_ring_) ||
+      !MapRing(XDP_UMEM_PGOFF_COMPLETION_RING, offsets.cr, sizeof(uint64_t),
+               &completion_ring_) ||
+      !MapRing(XDP_PGOFF_RX_RING, offsets.rx, sizeof(xdp_desc), &rx_ring_) ||
+      !MapRing(XDP_PGOFF_TX_RING, offsets.tx, sizeof(xdp_desc), &tx_ring_)) {
+    std::cerr << "Could not map AF_XDP rings: " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+  for (uint32_t i = 0; i < kRingSize; ++i) {
+    Fill(uint64_t(i) * kFrameSize);
+  }
+  for (uint32_t i = kRingSize; i < kNumFrames; ++i) {
+    free_tx_frames_.push_back(uint64_t(i) * kFrameSize);
+  }
+
+  // Copy mode works with any driver, including generic XDP.
+  sockaddr_xdp address = {};
+  address.sxdp_family = AF_XDP;
+  address.sxdp_flags = XDP_COPY;
+  address.sxdp_ifindex = ifindex;
+  address.sxdp_queue_id = queue_;
+  if (bind(fd_, (sockaddr*)&address, sizeof(address)) != 0) {
+    std::cerr << "Could not bind AF_XDP socket to " << interface_ << " queue "
+              << queue_ << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  return AttachProgram(ifindex);
+}
+
+int XDPSocket::fd() const {
+  return fd_;
+}
+
+bool XDPSocket::Receive(Datagram* datagram) {
+  while (true) {
+    const uint32_t consumer = *rx_ring_.consumer;
+    if (consumer == __atomic_load_n(rx_ring_.producer, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    const xdp_desc descriptor =
+        ((const xdp_desc*)rx_ring_.entries)[consumer & (kRingSize - 1)];
+    __atomic_store_n(rx_ring_.consumer, consumer + 1, __ATOMIC_RELEASE);
+
+    datagram->frame_address = descriptor.addr;
+    datagram->frame = umem_ + descriptor.addr;
+    datagram->frame_size = descriptor.len;
+
+    // The program only redirects IPv4 UDP datagrams for our port without IP
+    // options, but check anyway rather than trust the frame.
+    const unsigned char* frame = (const unsigned char*)datagram->frame;
+    const unsigned char* ip = frame + kEthernetHeaderSize;
+    const unsigned char* udp = ip + kIPv4HeaderSize;
+    if (descriptor.len < kEthernetHeaderSize + kIPv4HeaderSize +
+                             kUDPHeaderSize ||
+        ((frame[12] << 8) | frame[13]) != kIPv4EtherType || ip[0] != 0x45 ||
+        ip[9] != kUDPProtocol) {
+      Release(*datagram);
+      continue;
+    }
+    const size_t udp_size = (udp[4] << 8) | udp[5];
+    if (udp_size < kUDPHeaderSize ||
+        udp + udp_size > frame + descriptor.len) {
+      Release(*datagram);
+      continue;
+    }
+    uint32_t source_address;
+    memcpy(&source_address, ip + 12, sizeof(source_address));
+    datagram->remote_endpoint = boost::asio::ip::udp::endpoint(
+        boost::asio::ip::address_v4(ntohl(source_address)),
+        (udp[0] << 8) | udp[1]);
+    datagram->payload = (const char*)udp + kUDPHeaderSize;
+    datagram->payload_size = udp_size - kUDPHeaderSize;
+    return true;
+  }
+}
+
+bool XDPSocket::Send(const Datagram& datagram, const char* payload,
+                     size_t payload_size) {
+  const size_t frame_size = kEthernetHeaderSize + kIPv4HeaderSize +
+                            kUDPHeaderSize + payload_size;
+  Complete();
+  const uint32_t producer = *tx_ring_.producer;
+  if (frame_size > kFrameSize || free_tx_frames_.empty() ||
+      producer - __atomic_load_n(tx_ring_.consumer, __ATOMIC_ACQUIRE) >=
+          kRingSize) {
+    return false;
+  }
+  const uint64_t frame_address = free_tx_frames_.back();
+  free_tx_frames_.pop_back();
+
+  // Reply from where the datagram was sent to, to where it came from.
+  const unsigned char* request = (const unsigned char*)datagram.frame;
+  unsigned char* frame = (unsigned char*)umem_ + frame_address;
+  memcpy(frame, request + 6, 6);
+  memcpy(frame + 6, request, 6);
+  frame[12] = kIPv4EtherType >> 8;
+  frame[13] = kIPv4EtherType & 0xff;
+
+  const unsigned char* request_ip = request + kEthernetHeaderSize;
+  unsigned char* ip = frame + kEthernetHeaderSize;
+  const size_t ip_size = frame_size - kEthernetHeaderSize;
+  ip[0] = 0x45;
+  ip[1] = 0;
+  ip[2] = ip_size >> 8;
+  ip[3] = ip_size & 0xff;
+  ip[4] = 0;
+  ip[5] = 0;
+  ip[6] = 0x40;  // Don't fragment.
+  ip[7] = 0;
+  ip[8] = 64;
+  ip[9] = kUDPProtocol;
+  ip[10] = 0;
+  ip[11] = 0;
+  memcpy(ip + 12, request_ip + 16, 4);
+  memcpy(ip + 16, request_ip + 12, 4);
+  const uint16_t checksum = IPv4Checksum(ip);
+  ip[10] = checksum >> 8;
+  ip[11] = checksum & 0xff;
+
+  // UDP checksums are optional over IPv4.
+  const unsigned char* request_udp = request_ip + kIPv4HeaderSize;
+  unsigned char* udp = ip + kIPv4HeaderSize;
+  const size_t udp_size = kUDPHeaderSize + payload_size;
+  memcpy(udp, request_udp + 2, 2);
+  memcpy(udp + 2, request_udp, 2);
+  udp[4] = udp_size >> 8;
+  udp[5] = udp_size & 0xff;
+  udp[6] = 0;
+  udp[7] = 0;
+  memcpy(udp + kUDPHeaderSize, payload, payload_size);
+
+  xdp_desc& descriptor =
+      ((xdp_desc*)tx_ring_.entries)[producer & (kRingSize - 1)];
+  descriptor.addr = frame_address;
+  descriptor.len = frame_size;
+  descriptor.options = 0;
+  __atomic_store_n(tx_ring_.producer, producer + 1, __ATOMIC_RELEASE);
+
+  // In copy mode, the kernel only transmits when asked to.
+  sendto(fd_, nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+  return true;
+}
+
+void XDPSocket::Release(const Datagram& datagram) {
+  Fill(datagram.frame_address);
+}
+
+bool XDPSocket::MapRing(uint64_t offset, const xdp_ring_offset& ring_offset,
+                        size_t entry_size, Ring* ring) {
+  ring->map_size = ring_offset.desc + kRingSize * entry_size;
+  void* map = mmap(nullptr, ring->map_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd_, offset);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+  ring->map = map;
+  ring->producer = (uint32_t*)((char*)map + ring_offset.producer);
+  ring->consumer = (uint32_t*)((char*)map + ring_offset.consumer);
+  ring->flags = (uint32_t*)((char*)map + ring_offset.flags);
+  ring->entries = (char*)map + ring_offset.desc;
+  return true;
+}
+
+bool XDPSocket::AttachProgram(int ifindex) {
+  bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = queue_ + 1;
+  map_fd_ = BPF(BPF_MAP_CREATE, &attr);
+  if (map_fd_ < 0) {
+    std::cerr << "Could not create XSKMAP: " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  // Packet loads are in network byte order, so compare them against values
+  // in network byte order.
+  const int32_t ipv4 = htons(kIPv4EtherType);
+  const int32_t fragment_mask = htons(0x3fff);
+  const int32_t port = htons(port_);
+  const bpf_insn program[] = {
+    // r2 = data, r3 = data_end.
+    Instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1,
+                offsetof(xdp_md, data), 0),
+    Instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1,
+                offsetof(xdp_md, data_end), 0),
+    // Pass anything too short to hold Ethernet, IPv4 and UDP headers.
+    Instruction(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+    Instruction(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0,
+                kEthernetHeaderSize + kIPv4HeaderSize + kUDPHeaderSize),
+    Instruction(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 17, 0),
+    // EtherType is IPv4.
+    Instruction(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2, 12, 0),
+    Instruction(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 15, ipv4),
+    // IPv4 without options.
+    Instruction(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_4, BPF_REG_2, 14, 0),
+    Instruction(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 13, 0x45),
+    // UDP.
+    Instruction(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_4, BPF_REG_2, 23, 0),
+    Instruction(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 11, kUDPProtocol),
+    // Not a fragment.
+    Instruction(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2, 20, 0),
+    Instruction(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_4, 0, 0, fragment_mask),
+    Instruction(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 8, 0),
+    // Destination port.
+    Instruction(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2, 36, 0),
+    Instruction(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 6, port),
+    // return bpf_redirect_map(map, ctx->rx_queue_index, XDP_PASS);
+    Instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1,
+                offsetof(xdp_md, rx_queue_index), 0),
+    Instruction(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0,
+                map_fd_),
+    Instruction(0, 0, 0, 0, 0),
+    Instruction(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+    Instruction(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+    Instruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    // return XDP_PASS;
+    Instruction(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+    Instruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+  };
+  static const char kLicense[] = "Dual BSD/GPL";
+  char log[4096] = {};
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = (uintptr_t)program;
+  attr.insn_cnt = sizeof(program) / sizeof(program[0]);
+  attr.license = (uintptr_t)kLicense;
+  attr.log_buf = (uintptr_t)log;
+  attr.log_size = sizeof(log);
+  attr.log_level = 1;
+  program_fd_ = BPF(BPF_PROG_LOAD, &attr);
+  if (program_fd_ < 0) {
+    std::cerr << "Could not load XDP program: " << strerror(errno) << std::endl
+              << log << std::endl;
+    return false;
+  }
+
+  const uint32_t key = queue_;
+  const uint32_t value = fd_;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd_;
+  attr.key = (uintptr_t)&key;
+  attr.value = (uintptr_t)&value;
+  if (BPF(BPF_MAP_UPDATE_ELEM, &attr) != 0) {
+    std::cerr << "Could not add AF_XDP socket to XSKMAP: " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+
+  memset(&attr, 0, sizeof(attr));
+  attr.link_create.prog_fd = program_fd_;
+  attr.link_create.target_ifindex = ifindex;
+  attr.link_create.attach_type = BPF_XDP;
+  attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+  link_fd_ = BPF(BPF_LINK_CREATE, &attr);
+  if (link_fd_ < 0) {
+    std::cerr << "Could not attach XDP program to " << interface_ << ": "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void XDPSocket::Fill(uint64_t frame_address) {
+  const uint32_t producer = *fill_ring_.producer;
+  ((uint64_t*)fill_ring_.entries)[producer & (kRingSize - 1)] =
+      frame_address - frame_address % kFrameSize;
+  __atomic_store_n(fill_ring_.producer, producer + 1, __ATOMIC_RELEASE);
+}
+
+void XDPSocket::Complete() {
+  uint32_t consumer = *completion_ring_.consumer;
+  const uint32_t producer =
+      __atomic_load_n(completion_ring_.producer, __ATOMIC_ACQUIRE);
+  while (consumer != producer) {
+    free_tx_frames_.push_back(
+        ((const uint64_t*)completion_ring_.entries)[consumer &
+                                                    (kRingSize - 1)]);
+    ++consumer;
+  }
+  __atomic_store_n(completion_ring_.consumer, consumer, __ATOMIC_RELEASE);
+}
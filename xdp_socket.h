@@ -0,0 +1,110 @@
+/*
+ * Copyright 2016 Boris Kochergin. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <linux/if_xdp.h>
+
+#include <boost/asio.hpp>
+
+// An AF_XDP socket that receives IPv4 UDP datagrams addressed to a port
+// straight from one queue of a network interface, bypassing the kernel's
+// network stack, and sends replies to them the same way. An XDP program
+// attached to the interface in generic mode redirects matching frames to the
+// socket, so any Linux interface, including a veth, works.
+class XDPSocket {
+ public:
+  // A received datagram. Its frame stays owned by the caller until it is
+  // passed to Release().
+  struct Datagram {
+    uint64_t frame_address;
+    char* frame;
+    size_t frame_size;
+    const char* payload;
+    size_t payload_size;
+    boost::asio::ip::udp::endpoint remote_endpoint;
+  };
+
+  XDPSocket(const std::string& interface, uint32_t queue, uint16_t port);
+  ~XDPSocket();
+
+  // Creates the socket and attaches the XDP program to the interface.
+  bool Open();
+
+  // File descriptor to poll for incoming datagrams.
+  int fd() const;
+
+  // Takes the next datagram off the receive ring. Returns false if there is
+  // none.
+  bool Receive(Datagram* datagram);
+
+  // Sends a reply to a received datagram with the given payload.
+  bool Send(const Datagram& datagram, const char* payload,
+            size_t payload_size);
+
+  // Returns a received datagram's frame to the kernel.
+  void Release(const Datagram& datagram);
+
+ private:
+  // A single-producer, single-consumer ring shared with the kernel.
+  struct Ring {
+    uint32_t* producer;
+    uint32_t* consumer;
+    uint32_t* flags;
+    void* entries;
+    void* map;
+    size_t map_size;
+  };
+
+  const std::string interface_;
+  const uint32_t queue_;
+  const uint16_t port_;
+  int fd_;
+  int map_fd_;
+  int program_fd_;
+  int link_fd_;
+  char* umem_;
+  Ring fill_ring_;
+  Ring completion_ring_;
+  Ring rx_ring_;
+  Ring tx_ring_;
+
+  // UMEM frames available for transmission.
+  std::vector<uint64_t> free_tx_frames_;
+
+  bool MapRing(uint64_t offset, const xdp_ring_offset& ring_offset,
+               size_t entry_size, Ring* ring);
+
+  // Loads the program that redirects UDP datagrams for the port to the
+  // socket, and attaches it to the interface.
+  bool AttachProgram(int ifindex);
+
+  // Hands a frame to the kernel for receiving into.
+  void Fill(uint64_t frame_address);
+
+  // Reclaims frames the kernel is done transmitting.
+  void Complete();
+};